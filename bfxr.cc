@@ -0,0 +1,4 @@
+// The implementation of the synth, built as the bfxr_core library so the gui
+// and the tools don't each compile their own copy
+#define BFXR_IMPLEMENTATION
+#include "bfxr.h"
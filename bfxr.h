@@ -21,9 +21,18 @@
 
 #include <vector>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <cmath>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <array>
+#include <unordered_map>
+#include <functional>
 
 
 // ----------------------------------------------------------------------
@@ -38,6 +47,39 @@ namespace bfxr
   template<int f> struct AllOnes { enum {Value = (1 << (f-1) ) | AllOnes<f-1>::Value}; };
   template<> struct AllOnes<0> { enum {Value=0}; };
 
+  /*
+    Small and fast random number generator, one per synth so renders are
+    reproducible from a seed and can run on several threads.
+
+    xoshiro256** by David Blackman and Sebastiano Vigna, seeded with splitmix64
+    http://xoshiro.di.unimi.it/
+
+    License: public domain
+   */
+  class Random
+  {
+    private:
+      std::uint64_t state[4];
+
+    public:
+      explicit Random(std::uint64_t seed = 0);
+
+      void Seed(std::uint64_t seed);
+
+      std::uint64_t GetNext();
+
+      //returns number between 0 and 1, excluding 1
+      double operator()();
+
+      // Fills out with n numbers between -1 and 1, the same numbers n calls
+      // to operator() would give mapped to that range
+      void Fill(double* out, std::size_t n);
+  };
+
+  // The generator used by the functions that aren't given one, one per thread
+  // and seeded with 0 so it starts the same on every run
+  Random& DefaultRandom();
+
   /*
      Implementes the 1/f noise algorithm discovered by Richard F. Voss
      of the Thomas J. Watson Research Instritute of IBM as described in
@@ -59,10 +101,14 @@ namespace bfxr
       double white_values[NUMBER_OF_VALUES];
 
     public:
-      PinkNoise();
+      explicit PinkNoise(Random& random);
 
       //returns number between 0 and 1
-      double GetNextValue();
+      double GetNextValue(Random& random);
+
+      // Fills out with n numbers between -1 and 1, the same numbers n calls
+      // to GetNextValue() would give mapped to that range
+      void Fill(Random& random, double* out, std::size_t n);
   }; 
 }
 
@@ -179,18 +225,37 @@ namespace bfxr
 
       void setAllLocked(bool locked);
       void generatePickupCoin();
+      void generatePickupCoin(Random& random);
       void generateLaserShoot();
+      void generateLaserShoot(Random& random);
       void generateExplosion();
+      void generateExplosion(Random& random);
       void generatePowerup();
+      void generatePowerup(Random& random);
       void generateHitHurt();
+      void generateHitHurt(Random& random);
       void generateJump();
+      void generateJump(Random& random);
       void generateBlipSelect();
+      void generateBlipSelect(Random& random);
       void resetParams();
       void mutate(double mutation = 0.05);
+      void mutate(Random& random, double mutation = 0.05);
       void randomize();
+      void randomize(Random& random);
 
       // make sure all the doubles are within range
       void makeValid();
+
+      // The comma separated string the flash version copies to the clipboard
+      // and saves as .bfxrsound: the wave type and the values in the order
+      // above followed by the names of the locked parameters
+      std::string serialize() const;
+
+      // Reads a string written by serialize() or by the flash version, returns
+      // false and leaves the params unchanged if it can't be read or a value is
+      // outside the range of its slider
+      bool deserialize(const std::string& str);
   };
 }
 
@@ -352,108 +417,7 @@ namespace bfxr
 #define BFXR_PARAM_bitCrush_RANDOM_POWER 4
 #define BFXR_PARAM_bitCrushSweep_RANDOM_POWER 5
 
-
-
-namespace bfxr
-{
-  void GenerateSound(const BfxrParams& params, std::vector<double>* data);
-
-
-  // Copied straight out of sfxr source
-  // license: MIT
-  bool SaveWav(const char* filename, const std::vector<double>& data);
-}
-
-// ----------------------------------------------------------------------
-// Implementation section
-// ----------------------------------------------------------------------
-
-#ifdef BFXR_IMPLEMENTATION
-
-#include <vector>
-#include <cstdlib>
-
-#include <vector>
-#include <string>
-#include <cmath>
-
-#include <cmath>
-#include <vector>
-
-namespace bfxr
-{
-  double random()
-  {
-    return rand() / static_cast<double>(RAND_MAX);
-  }
-
-  PinkNoise::PinkNoise()
-    : index(0)
-  {
-    for (int i = 0; i < NUMBER_OF_VALUES; i++)
-    {
-      white_values[i] = random();
-    }
-  }
-
-  double PinkNoise::GetNextValue()
-  {
-    const int last_index = index;
-
-    index++;
-    if (index > AllOnes<NUMBER_OF_VALUES>::Value)
-    {
-      index = 0;
-    }
-
-    // Exclusive-Or previous value with current value. This gives
-    // a list of bits that have changed.
-    const int diff = last_index ^ index;
-
-    double sum = 0;
-    for (int i = 0; i < NUMBER_OF_VALUES; i++)
-    {
-      // If bit changed get new random number for corresponding white_value
-      if (diff & (1 << i))
-        white_values[i] = random();
-      sum += white_values[i];
-    }
-
-    // the gardner article uses the dice sum but since we care about keeping
-    // the 0-1 range we divide by the ammount of stored randoms
-    return sum/NUMBER_OF_VALUES;
-  }
-}
-
-
-namespace bfxr
-{
-  /**
-   * BfxrParams
-   * 
-   * Copyright 2010 Thomas Vian
-   *
-   * Licensed under the Apache License, Version 2.0 (the "License");
-   * you may not use this file except in compliance with the License.
-   * You may obtain a copy of the License at
-   *
-   * 	http://www.apache.org/licenses/LICENSE-2.0
-   *
-   * Unless required by applicable law or agreed to in writing, software
-   * distributed under the License is distributed on an "AS IS" BASIS,
-   * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-   * See the License for the specific language governing permissions and
-   * limitations under the License.
-   * 
-   * @author Thomas Vian
-   */
-
-  BfxrParams::BfxrParams()
-  {
-    makeValid();
-    resetParams();
-  }
-
+// Calls ONVAR(p) for every double parameter p, in the order they are declared
 #define ALLVALUES\
   ONVAR(masterVolume);\
   ONVAR(attackTime);\
@@ -487,976 +451,3467 @@ namespace bfxr
   ONVAR(bitCrush);\
   ONVAR(bitCrushSweep);
 
-  void BfxrParams::makeValid()
-  {
-#define ONVAR(n) do { n = BFXR_PARAM_##n##_DEF; } while(false)
-    ALLVALUES
-#undef ONVAR
-  }
 
-  void BfxrParams::setAllLocked(bool locked)
+
+namespace bfxr
+{
+  // Instruction sets the oscillators can be computed with
+  enum class SimdLevel
   {
-    waveType_locked = locked;
-#define ONVAR(p) p##_locked = locked
-    ALLVALUES
-#undef ONVAR
-  }
+    Scalar,
+    Sse2,
+    Avx2
+  };
 
-  void BfxrParams::generatePickupCoin()
+  // Returns the best instruction set supported by the cpu we are running on
+  SimdLevel DetectSimdLevel();
+
+  // Precision of the sample path of the synth, the envelope, pitch and phase
+  // are always computed in double precision
+  enum class Precision
   {
-    resetParams();
+    Double,   // The reference
+    Float     // Twice as many samples per vector, tools/compare_precision.cc measures the error
+  };
 
-    startFrequency =0.4+random()*0.5;
+  // The sample rate the synth constants and the Flash original are tuned for
+  constexpr int ReferenceSampleRate = 44100;
 
-    sustainTime = random() * 0.1;
-    decayTime = 0.1 + random() * 0.4;
-    sustainPunch = 0.3 + random() * 0.3;
+  // Engine settings for rendering a sound
+  struct RenderSettings
+  {
+    // The noise waves are random, a params and seed pair always renders the
+    // same samples
+    std::uint64_t seed = 0;
+
+    Precision precision = Precision::Double;
+    SimdLevel simdLevel = DetectSimdLevel();
+
+    // Sub-samples computed per output sample: 8, 4, 2 or 1. Below 8 the
+    // oscillators are band-limited with polyBLEP/polyBLAMP instead of relying
+    // on the brute force supersampling
+    int oversampling = 8;
+
+    // Output sample rate, the time constants are scaled from the rate the
+    // parameters were tuned for so a sound is the same at any rate
+    int sampleRate = ReferenceSampleRate;
+
+    // Uses polynomial approximations instead of pow(), tan() and sin() for the
+    // compressor, the Tan wave and the vibrato. The error of each is below
+    // 2e-7, see FastPow() and friends for the bounds
+    bool fastMath = false;
+  };
 
-    if(random() < 0.5) 
-    {
-      changeSpeed = 0.5 + random() * 0.2;
-      auto cnum = int(random()*7)+1;
-      auto cden = cnum+int(random()*7)+2;
+  namespace detail
+  {
+    template<typename Real>
+    struct OscillatorInput;
 
-      changeAmount =static_cast<double>(cnum)/cden;
-    }
+    template<typename Real>
+    using OscillatorFunction = void (*)(const OscillatorInput<Real>& input, Real* out);
 
+    // Adds in multiplied by volume to out
+    using MixFunction = void (*)(float* out, const float* in, float volume, std::size_t n);
   }
 
-  void BfxrParams::generateLaserShoot()
+  class SynthCheckpoints;
+
+  /**
+   * BfxrSynth
+   * 
+   * Copyright 2010 Thomas Vian
+   *
+   * Licensed under the Apache License, Version 2.0 (the "License");
+   * you may not use this file except in compliance with the License.
+   * You may obtain a copy of the License at
+   *
+   * 	http://www.apache.org/licenses/LICENSE-2.0
+   *
+   * Unless required by applicable law or agreed to in writing, software
+   * distributed under the License is distributed on an "AS IS" BASIS,
+   * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   * See the License for the specific language governing permissions and
+   * limitations under the License.
+   * 
+   * @author Thomas Vian
+   */
+  struct BfxrSynth 
   {
-    resetParams();
+    BfxrSynth(const BfxrParams& p, const RenderSettings& settings = RenderSettings());
 
-    auto wt = static_cast<unsigned int>(random() * 3);
-    if( wt == 2 && random() < 0.5) 
-    {
-      wt = static_cast<unsigned int>(random() * 2);
-    }
-    waveType = static_cast<WaveType>(wt);
+    // Starts a new sound with the same render settings, reusing the memory of
+    // this synth. Nothing is allocated once the flanger buffer has room for it
+    void start(const BfxrParams& p, std::uint64_t seed);
 
-    startFrequency =0.5 + random() * 0.5;
-    minFrequency =startFrequency - 0.2 - random() * 0.6;
+    // Size of the flanger buffer at the given sample rate
+    static std::size_t flangerBufferSize(int sampleRate);
 
-    if(minFrequency < 0.2) 
-      minFrequency =0.2;
+    // Renders the next sample like renderBlock, 0 once the sound has ended
+    double synthOneSample();
 
-    slide = -0.15 - random() * 0.2;			
+    // Renders n samples with a kernel specialized at compile time for the wave
+    // and the effects that are used, picked by reset(true)
+    template<typename Real, WaveType W, bool Filters, bool Flanger, bool Vibrato, bool Overtones>
+    void synthBlock(Real* out, std::size_t n);
 
-    if(random() < 0.33)
-    {
-      startFrequency = random() * 0.6;
-      minFrequency = random() * 0.1;
-      slide = -0.35 - random() * 0.3;
-    }
+    template<typename Real>
+    using Kernel = void (BfxrSynth::*)(Real* out, std::size_t n);
 
-    if(random() < 0.5) 
-    {
-      squareDuty = random() * 0.5;
-      dutySweep = random() * 0.2;
-    }
-    else
-    {
-      squareDuty = 0.4 + random() * 0.5;
-      dutySweep =- random() * 0.7;	
-    }
+    // Renders the next n samples of the sound into a buffer owned by the caller.
+    // Returns the number of samples written, which is less than n once the end
+    // of the sound is reached.
+    std::size_t renderBlock(float* out, std::size_t n);
+    std::size_t renderBlock(double* out, std::size_t n);
 
-    sustainTime = 0.1 + random() * 0.2;
-    decayTime = random() * 0.4;
-    if(random() < 0.5) sustainPunch = random() * 0.3;
+    template<typename T>
+    std::size_t renderInto(T* out, std::size_t n);
 
-    if(random() < 0.33)
-    {
-      flangerOffset = random() * 0.2;
-      flangerSweep = -random() * 0.2;
-    }
+    // Number of samples rendered so far
+    std::size_t position() const;
 
-    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
-  }
+    // Moves the render to the given sample. Going forward renders the samples
+    // in between and throws them away, going back starts over from the first
+    // sample, use SynthCheckpoints to avoid both on long sounds
+    void seek(std::size_t sample);
 
-  void BfxrParams::generateExplosion()
-  {
-    resetParams();
-    waveType = WaveType::Noise;
+    // Selects the instruction set used by the oscillators. The noise and tan
+    // waves are always computed with the scalar code.
+    void setSimdLevel(SimdLevel level);
 
-    if(random() < 0.5)
-    {
-      startFrequency = 0.1 + random() * 0.4;
-      slide = -0.1 + random() * 0.4;
-    }
-    else
-    {
-      startFrequency = 0.2 + random() * 0.7;
-      slide = -0.2 - random() * 0.2;
-    }
+    // Computes the 8 sub-samples of the current sample using the scalar
+    // oscillator, this is the reference for the vectorized oscillators.
+    template<WaveType W, bool Overtones, bool BandLimited, typename Real>
+    void oscillate(Real* out);
 
-    startFrequency = startFrequency * startFrequency;
+    template<WaveType W>
+    void advancePhase(int step);
 
-    if(random() < 0.2) slide = 0.0;
-    if(random() < 0.33) repeatSpeed = 0.3 + random() * 0.5;
+    template<typename Real>
+    detail::OscillatorFunction<Real> getOscillator() const;
 
-    sustainTime = 0.1 + random() * 0.3;
-    decayTime = random() * 0.5;
-    sustainPunch = 0.2 + random() * 0.6;
+    // Stretches the envelope stages so the sound lasts at least MIN_LENGTH
+    static void clampTotalLength(double* attack, double* sustain, double* decay);
 
-    if(random() < 0.5)
-    {
-      flangerOffset = -0.3 + random() * 0.9;
-      flangerSweep = -random() * 0.3;
-    }
+    /**
+     * Resets the runing variables from the params
+     * Used once at the start (total reset) and for the repeat effect (partial reset)
+     * @param	totalReset	If the reset is total
+     */
+    void reset(bool totalReset);
 
-    if(random() < 0.33)
-    {
-      changeSpeed = 0.6 + random() * 0.3;
-      changeAmount = 0.8 - random() * 1.6;
-    }
-  }
+    unsigned int GetNumberOfSamples();
 
-  void BfxrParams::generatePowerup()
-  {
-    resetParams();
+    void GenerateSound(std::vector<double>* data, SynthCheckpoints* checkpoints = nullptr);
+    void GenerateSound(std::vector<float>* data, SynthCheckpoints* checkpoints = nullptr);
 
-    if(random() < 0.5) waveType = WaveType::Saw;
-    else 					squareDuty = random() * 0.6;
+    // Same as above for renders on another thread that a newer one can make
+    // useless: cancelled is asked before each GenerateBlockSize samples, once
+    // it returns true data is left as it was and false is returned
+    bool GenerateSound(std::vector<double>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled);
+    bool GenerateSound(std::vector<float>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled);
 
-    if(random() < 0.5)
-    {
-      startFrequency = 0.2 + random() * 0.3;
-      slide = 0.1 + random() * 0.4;
-      repeatSpeed = 0.4 + random() * 0.4;
-    }
-    else
-    {
-      startFrequency = 0.2 + random() * 0.3;
-      slide = 0.05 + random() * 0.2;
+    template<typename T>
+    bool generateInto(std::vector<T>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled);
 
-      if(random() < 0.5)
+    static constexpr std::size_t GenerateBlockSize = 4096;
+
+    // Clamps n to the number of samples left of the sound
+    std::size_t samplesLeft(std::size_t n);
+
+    static constexpr int LoResNoisePeriod= 8;
+    static constexpr double MIN_LENGTH = 0.18;
+
+    //--------------------------------------------------------------------------
+    //
+    //  Synth Variables
+    //
+    //  Ordered by how often they are used: the per sample state comes first so
+    //  the kernels touch a few cache lines, the noise buffers are inline so a
+    //  synth allocates nothing but the flanger buffer, and what is only read
+    //  by reset() is kept at the end
+    //
+    //--------------------------------------------------------------------------
+
+    // Per sample state
+
+    double _period;							// Period of the wave
+    double _periodTemp;						// Period modified by vibrato
+    double _maxPeriod;						// Maximum period before sound stops (from minFrequency)
+    double _slide;							// Note slide
+    double _deltaSlide;						// Change in slide
+    double _minFreqency;					// Minimum frequency before stopping
+
+    double _changePeriod;
+    double _changeAmount;					// Amount to change the note by
+    double _changeAmount2;					// Amount to change the note by
+
+    double _vibratoPhase;					// Phase through the vibrato sine wave
+    double _vibratoSpeed;					// Speed at which the vibrato phase moves
+    double _vibratoAmplitude;				// Amount to change the period of the wave by at the peak of the vibrato wave
+
+    double _squareDuty;						// Offset of center switching point in the square wave
+    double _dutySweep;						// Amount to change the duty by
+
+    double _envelopeVolume;					// Current volume of the envelope
+    double _envelopeTime;					// Current time through current enelope stage
+    double _envelopeLength;					// Length of the current envelope stage
+    double _envelopeOverLength0;			// 1 / _envelopeLength0 (for quick calculations)
+    double _envelopeOverLength1;			// 1 / _envelopeLength1 (for quick calculations)
+    double _envelopeOverLength2;			// 1 / _envelopeLength2 (for quick calculations)
+    double _sustainPunch;					// The punch factor (louder at begining of sustain)
+
+    double _flangerOffset;					// Phase offset for flanger effect
+    double _flangerDeltaOffset;				// Change in phase offset
+
+    double _lpFilterPos;					// Adjusted wave position after low-pass filter
+    double _lpFilterDeltaPos;				// Change in low-pass wave position, as allowed by the cutoff and damping
+    double _lpFilterCutoff;					// Cutoff multiplier which adjusts the amount the wave position can move
+    double _lpFilterDeltaCutoff;			// Speed of the low-pass cutoff multiplier
+    double _lpFilterDamping;				// Damping muliplier which restricts how fast the wave position can move
+    double _hpFilterPos;					// Adjusted wave position after high-pass filter
+    double _hpFilterCutoff;					// Cutoff multiplier which adjusts the amount the wave position can move
+    double _hpFilterDeltaCutoff;			// Speed of the high-pass cutoff multiplier
+
+    double _pos;							// Phase expresed as a Number from 0-1, used for fast sin approx
+    double _overtoneFalloff;					// Minimum frequency before stopping
+    double _masterVolume;					// masterVolume * masterVolume (for quick calculations)
+
+    double _bitcrush_freq;					// inversely proportional to the number of samples to skip 
+    double _bitcrush_freq_sweep;			// change of the above
+    double _bitcrush_phase;					// samples when this > 1
+    double _bitcrush_last;					// last sample value
+
+    double _compression_factor;
+    double _rateRatio;						// ReferenceSampleRate / sample rate, scales the per sample constants
+
+    double _oneBitNoise;					// Current sample of one-bit noise.
+    double _buzz;							// Current sample of 'buzz' noise.
+
+    int _phase;								// Phase through the wave
+    int _overtones;					// Minimum frequency before stopping
+    int _envelopeStage;						// Current stage of the envelope (attack, sustain, decay, end)
+    int _changePeriodTime;
+    int _changeTime;						// Counter for the note change
+    int _changeLimit;						// Once the time reaches this limit, the note changes
+    int _changeTime2;						// Counter for the note change
+    int _changeLimit2;						// Once the time reaches this limit, the note changes
+    int _repeatTime;						// Counter for the repeats
+    int _repeatLimit;						// Once the time reaches this limit, some of the variables are reset
+    int _flangerInt;							// Integer flanger offset, for bit maths
+    int _flangerPos;							// Position through the flanger buffer
+    int _holdShift;							// log2 of how many sub-samples each oscillator value is held for
+    int _oneBitNoiseState;					// Buffer containing one-bit periodic noise state.
+    int _buzzState;							// Buffer containing 'buzz' periodic noise state.
+
+    bool _finished;						// If the sound has finished
+    bool _muted;							// Whether or not min frequency has been attained
+    bool _changeReached;
+    bool _changeReached2;
+    bool _lpFilterOn;					// If the low pass filter is active
+
+    // Noise, only used by the noise waves
+
+    Random _random;							// Noise source, seeded from the render settings
+    PinkNoise _pinkNumber;
+    double _noiseBuffer[32];			// Buffer of random values used to generate noise
+    double _pinkNoiseBuffer[32];			// Buffer of random values used to generate noise
+
+    // Per block state
+
+    Kernel<double> _kernel;					// Renders samples for the current wave and effects
+    Kernel<float> _kernelFloat;				// Same as above but in single precision
+    detail::OscillatorFunction<double> _oscillator;		// Vectorized oscillator, null if the scalar one is used
+    detail::OscillatorFunction<float> _oscillatorFloat;	// Same as above but for the float kernels
+    std::size_t _sampleIndex;					// Number of samples written by renderBlock
+    double _envelopeFullLength;				// Full length of the volume envelop (and therefore sound)
+    double _envelopeLength1;				// Length of the sustain stage
+    double _envelopeLength2;				// Length of the decay stage
+
+    // Only allocated when the flanger is used, 1024 entries at 44.1kHz
+    std::vector<double> _flangerBuffer;			// Buffer of wave values used to create the out of phase second wave
+
+    // Read by reset() and when starting over
+
+    double _envelopeLength0;				// Length of the attack stage
+    WaveType _waveType;							// The type of wave to generate
+    bool _flanger;						// If the flanger is active
+    bool _filters;						// If the filters are active
+    RenderSettings _settings;				// Precision and instruction set to render with
+    BfxrParams _params;	// Params instance
+  };
+
+  // Copies of a synth taken every interval samples while it renders. The synth
+  // holds no pointers to itself so a copy is a complete snapshot of the
+  // phases, filters, flanger buffer, noise and random generator, and restoring
+  // the closest one lets a long sound be played from any point while only
+  // rendering at most interval samples
+  class SynthCheckpoints
+  {
+    public:
+      explicit SynthCheckpoints(std::size_t interval = 8192);
+
+      // Renders like BfxrSynth::renderBlock and records a copy of the synth
+      // each time it reaches a multiple of the interval
+      std::size_t renderBlock(BfxrSynth* synth, float* out, std::size_t n);
+      std::size_t renderBlock(BfxrSynth* synth, double* out, std::size_t n);
+
+      // Restores the last checkpoint at or before sample into synth and
+      // renders the rest of the way. The checkpoints are only valid for the
+      // params and settings they were recorded with
+      void seek(BfxrSynth* synth, std::size_t sample) const;
+
+      void clear();
+
+      std::size_t interval() const;
+      std::size_t size() const;
+
+    private:
+      template<typename T>
+      std::size_t renderInto(BfxrSynth* synth, T* out, std::size_t n);
+
+      std::size_t _interval;
+      std::vector<BfxrSynth> _checkpoints;	// _checkpoints[i] is at sample i * _interval
+  };
+
+  // Plays many sounds at once with a fixed number of voices, for synthesizing
+  // sound effects while a game runs. Any thread may call play(), the sounds
+  // are handed to the audio thread through a lock-free queue and picked up by
+  // the next mix(), which is meant to be called from the audio callback and
+  // neither locks nor allocates.
+  //
+  // When every voice is busy the voice with the lowest priority is stolen,
+  // the oldest one of those if there are several. A sound is dropped instead
+  // if all voices play sounds with a higher priority.
+  class Mixer
+  {
+    public:
+      explicit Mixer(int voices = 32, const RenderSettings& settings = RenderSettings(), std::size_t queueSize = 64);
+
+      // Queues a sound to start at the next mix(), returns false if the queue
+      // is full. Safe to call from any number of threads
+      bool play(const BfxrParams& params, float volume = 1.0f, int priority = 0);
+
+      // Queues stopping every voice. Safe to call from any thread
+      bool stopAll();
+
+      // Writes the next n samples of all the playing voices added together,
+      // call from a single thread
+      void mix(float* out, std::size_t n);
+
+      // Number of voices playing at the end of the last mix()
+      int activeVoices() const;
+
+    private:
+      struct Command
+      {
+        enum class Type { Play, StopAll };
+
+        Type type;
+        BfxrParams params;
+        float volume;
+        int priority;
+      };
+
+      // Bounded multi-producer queue by Dmitry Vyukov, each slot tells by its
+      // sequence whether it is free for the producers or ready for the mixer
+      struct Slot
+      {
+        std::atomic<std::size_t> sequence;
+        Command command;
+      };
+
+      struct Voice
+      {
+        Voice(const BfxrParams& params, const RenderSettings& settings);
+
+        BfxrSynth synth;
+        float volume;
+        int priority;
+        std::uint64_t started;		// Number of the sound, older sounds are stolen first
+        bool playing;
+      };
+
+      bool push(const Command& command);
+      bool pop(Command* command);
+      void start(const Command& command);
+
+      static constexpr std::size_t MixBlockSize = 256;
+
+      RenderSettings _settings;
+      std::vector<Voice> _voices;
+      std::vector<float> _block;					// Samples of one voice before they are mixed in
+      detail::MixFunction _mix;
+
+      std::unique_ptr<Slot[]> _slots;
+      std::size_t _slotMask;
+      std::atomic<std::size_t> _enqueuePosition;
+      std::size_t _dequeuePosition;					// Only used by mix()
+
+      std::uint64_t _started;					// Number of sounds started, also seeds the voices
+      std::atomic<int> _activeVoices;
+  };
+
+  // Keeps rendered sounds in memory so rendering the same sound again is only
+  // a lookup. Sounds are keyed by the params and the render settings, with the
+  // params rounded to a millionth so values that only differ by rounding end
+  // up as the same sound. What can't change the sound is left out of the key:
+  // the locks, the duty of the waves that aren't square and the seed of the
+  // waves without noise. When the sounds take up more than the budget the
+  // least recently used are evicted.
+  //
+  // Safe to use from several threads. A sound that is missing in several
+  // threads at once is rendered by each of them
+  class RenderCache
+  {
+    public:
+      explicit RenderCache(std::size_t budgetBytes = 64 * 1024 * 1024);
+
+      // Returns the sound, rendering and adding it if it isn't cached
+      std::shared_ptr<const std::vector<double>> get(const BfxrParams& params, const RenderSettings& settings = RenderSettings());
+
+      // Returns the sound if it is cached, nullptr otherwise
+      std::shared_ptr<const std::vector<double>> find(const BfxrParams& params, const RenderSettings& settings = RenderSettings());
+
+      // Adds a sound rendered elsewhere, sounds bigger than the budget aren't kept
+      std::shared_ptr<const std::vector<double>> insert(const BfxrParams& params, const RenderSettings& settings, std::vector<double> sound);
+
+      void setBudget(std::size_t budgetBytes);
+      void clear();
+
+      std::size_t budget() const;
+      std::size_t memoryUsed() const;
+      std::size_t size() const;
+
+      // Lookups with get() and find() that did and didn't find the sound
+      std::uint64_t hits() const;
+      std::uint64_t misses() const;
+      void resetCounters();
+
+    private:
+      // The wave type followed by the quantized double parameters
+      using Values = std::array<std::int64_t, 32>;
+
+      struct Key
+      {
+        Values values;
+        std::uint64_t seed;
+        Precision precision;
+        SimdLevel simdLevel;
+        int oversampling;
+        int sampleRate;
+        bool fastMath;
+
+        bool operator==(const Key& other) const;
+      };
+
+      struct KeyHash
+      {
+        std::size_t operator()(const Key& key) const;
+      };
+
+      struct Entry
+      {
+        Key key;
+        std::shared_ptr<const std::vector<double>> sound;
+        std::size_t bytes;
+      };
+
+      using Entries = std::list<Entry>;
+
+      static Key makeKey(const BfxrParams& params, const RenderSettings& settings);
+      std::shared_ptr<const std::vector<double>> lookup(const Key& key);
+      void evict();
+
+      mutable std::mutex _mutex;
+      Entries _entries;								// Most recently used first
+      std::unordered_map<Key, Entries::iterator, KeyHash> _index;
+      std::size_t _budget;
+      std::size_t _used;
+      std::uint64_t _hits;
+      std::uint64_t _misses;
+  };
+}
+
+namespace bfxr
+{
+  void GenerateSound(const BfxrParams& params, std::vector<double>* data, const RenderSettings& settings = RenderSettings());
+  void GenerateSound(const BfxrParams& params, std::vector<float>* data, const RenderSettings& settings = RenderSettings());
+
+  // Drops the zeros at the end of data, the silence after the sound was muted
+  // or faded out, but nothing before offset
+  void TrimSilence(std::vector<double>* data, std::size_t offset = 0);
+  void TrimSilence(std::vector<float>* data, std::size_t offset = 0);
+
+  // Renders many sounds, the same as calling GenerateSound() for each of them.
+  // Sounds of the same wave are rendered together with one sound per vector
+  // lane when the render settings allow it, which is a lot faster for banks of
+  // variations of a sound. The noise waves, Tan, the flanger, float precision
+  // and oversampling below 8 are rendered one sound at a time
+  void GenerateSounds(const std::vector<BfxrParams>& params, std::vector<std::vector<double>>* sounds, const RenderSettings& settings = RenderSettings());
+
+
+  // Copied straight out of sfxr source
+  // license: MIT
+  bool SaveWav(const char* filename, const std::vector<double>& data, int sampleRate = ReferenceSampleRate);
+
+  // Resamples a sound with a windowed sinc, for sounds that were already
+  // rendered at another rate. Prefer RenderSettings::sampleRate when rendering
+  void Resample(const std::vector<double>& input, int inputRate, std::vector<double>* output, int outputRate);
+
+  // Clamps samples to -1..1 and converts them to 16 bit for audio devices
+  // that want integers, the same as static_cast<std::int16_t>(32767 * sample)
+  void FloatToS16(const float* in, std::int16_t* out, std::size_t n, SimdLevel level = DetectSimdLevel());
+}
+
+// ----------------------------------------------------------------------
+// Implementation section
+// ----------------------------------------------------------------------
+
+#ifdef BFXR_IMPLEMENTATION
+
+#include <vector>
+#include <cstdlib>
+
+#include <vector>
+#include <string>
+#include <cmath>
+
+#include <cmath>
+#include <vector>
+
+#include <cassert>
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+
+// The vectorized oscillators rely on the generic code being flattened into the
+// target specific functions, gcc and clang only does that when optimizing
+#if !defined(BFXR_NO_SIMD) && (defined(_MSC_VER) || defined(__OPTIMIZE__)) && \
+  (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define BFXR_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BFXR_SIMD_INLINE __forceinline
+#define BFXR_TARGET_SSE2
+#define BFXR_TARGET_AVX2
+#define BFXR_FLATTEN
+#else
+#define BFXR_SIMD_INLINE inline
+#define BFXR_TARGET_SSE2 __attribute__((target("sse2")))
+#define BFXR_TARGET_AVX2 __attribute__((target("avx2")))
+#define BFXR_FLATTEN __attribute__((flatten))
+#endif
+
+namespace bfxr
+{
+  Random::Random(std::uint64_t seed)
+  {
+    Seed(seed);
+  }
+
+  void Random::Seed(std::uint64_t seed)
+  {
+    // splitmix64, so similar seeds still gives unrelated states
+    for (int i = 0; i < 4; i++)
+    {
+      seed += 0x9e3779b97f4a7c15ull;
+      std::uint64_t z = seed;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      state[i] = z ^ (z >> 31);
+    }
+  }
+
+  namespace detail
+  {
+    inline std::uint64_t Rotl(std::uint64_t x, int k)
+    {
+      return (x << k) | (x >> (64 - k));
+    }
+
+    inline int CountTrailingZeros(unsigned int bits)
+    {
+#ifdef _MSC_VER
+      unsigned long index;
+      _BitScanForward(&index, bits);
+      return static_cast<int>(index);
+#else
+      return __builtin_ctz(bits);
+#endif
+    }
+  }
+
+  std::uint64_t Random::GetNext()
+  {
+    using detail::Rotl;
+    const std::uint64_t result = Rotl(state[1] * 5, 7) * 9;
+    const std::uint64_t t = state[1] << 17;
+
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = Rotl(state[3], 45);
+
+    return result;
+  }
+
+  double Random::operator()()
+  {
+    // the top 53 bits fills the mantissa of a double
+    return (GetNext() >> 11) * (1.0 / 9007199254740992.0);
+  }
+
+  void Random::Fill(double* out, std::size_t n)
+  {
+    using detail::Rotl;
+
+    // GetNext() with the state in registers, a buffer of noise costs about
+    // as much as the numbers themselves instead of a store of the state each
+    std::uint64_t s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3];
+    for(std::size_t i = 0; i < n; i += 1)
+    {
+      const std::uint64_t result = Rotl(s1 * 5, 7) * 9;
+      const std::uint64_t t = s1 << 17;
+      s2 ^= s0;
+      s3 ^= s1;
+      s1 ^= s2;
+      s0 ^= s3;
+      s2 ^= t;
+      s3 = Rotl(s3, 45);
+
+      // (result >> 11) / 2^53 * 2 - 1, both steps are exact
+      out[i] = (result >> 11) * (1.0 / 4503599627370496.0) - 1.0;
+    }
+    state[0] = s0;
+    state[1] = s1;
+    state[2] = s2;
+    state[3] = s3;
+  }
+
+  Random& DefaultRandom()
+  {
+    thread_local Random random;
+    return random;
+  }
+
+  PinkNoise::PinkNoise(Random& random)
+    : index(0)
+  {
+    for (int i = 0; i < NUMBER_OF_VALUES; i++)
+    {
+      white_values[i] = random();
+    }
+  }
+
+  double PinkNoise::GetNextValue(Random& random)
+  {
+    const int last_index = index;
+
+    index++;
+    if (index > AllOnes<NUMBER_OF_VALUES>::Value)
+    {
+      index = 0;
+    }
+
+    // Exclusive-Or previous value with current value. This gives
+    // a list of bits that have changed, visited from the lowest one up.
+    for (unsigned int diff = last_index ^ index; diff != 0; diff &= diff - 1)
+    {
+      // If bit changed get new random number for corresponding white_value
+      white_values[detail::CountTrailingZeros(diff)] = random();
+    }
+
+    double sum = 0;
+    for (int i = 0; i < NUMBER_OF_VALUES; i++)
+    {
+      sum += white_values[i];
+    }
+
+    // the gardner article uses the dice sum but since we care about keeping
+    // the 0-1 range we divide by the ammount of stored randoms
+    return sum/NUMBER_OF_VALUES;
+  }
+
+  void PinkNoise::Fill(Random& random, double* out, std::size_t n)
+  {
+    for (std::size_t i = 0; i < n; i++)
+    {
+      out[i] = GetNextValue(random) * 2.0 - 1.0;
+    }
+  }
+}
+
+
+namespace bfxr
+{
+  /**
+   * BfxrParams
+   * 
+   * Copyright 2010 Thomas Vian
+   *
+   * Licensed under the Apache License, Version 2.0 (the "License");
+   * you may not use this file except in compliance with the License.
+   * You may obtain a copy of the License at
+   *
+   * 	http://www.apache.org/licenses/LICENSE-2.0
+   *
+   * Unless required by applicable law or agreed to in writing, software
+   * distributed under the License is distributed on an "AS IS" BASIS,
+   * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   * See the License for the specific language governing permissions and
+   * limitations under the License.
+   * 
+   * @author Thomas Vian
+   */
+
+  BfxrParams::BfxrParams()
+  {
+    makeValid();
+    resetParams();
+  }
+
+  void BfxrParams::makeValid()
+  {
+#define ONVAR(n) do { n = BFXR_PARAM_##n##_DEF; } while(false)
+    ALLVALUES
+#undef ONVAR
+  }
+
+  void BfxrParams::setAllLocked(bool locked)
+  {
+    waveType_locked = locked;
+#define ONVAR(p) p##_locked = locked
+    ALLVALUES
+#undef ONVAR
+  }
+
+  void BfxrParams::generatePickupCoin()
+  {
+    generatePickupCoin(DefaultRandom());
+  }
+
+  void BfxrParams::generatePickupCoin(Random& random)
+  {
+    resetParams();
+
+    startFrequency =0.4+random()*0.5;
+
+    sustainTime = random() * 0.1;
+    decayTime = 0.1 + random() * 0.4;
+    sustainPunch = 0.3 + random() * 0.3;
+
+    if(random() < 0.5) 
+    {
+      changeSpeed = 0.5 + random() * 0.2;
+      auto cnum = int(random()*7)+1;
+      auto cden = cnum+int(random()*7)+2;
+
+      changeAmount =static_cast<double>(cnum)/cden;
+    }
+
+  }
+
+  void BfxrParams::generateLaserShoot()
+  {
+    generateLaserShoot(DefaultRandom());
+  }
+
+  void BfxrParams::generateLaserShoot(Random& random)
+  {
+    resetParams();
+
+    auto wt = static_cast<unsigned int>(random() * 3);
+    if( wt == 2 && random() < 0.5) 
+    {
+      wt = static_cast<unsigned int>(random() * 2);
+    }
+    waveType = static_cast<WaveType>(wt);
+
+    startFrequency =0.5 + random() * 0.5;
+    minFrequency =startFrequency - 0.2 - random() * 0.6;
+
+    if(minFrequency < 0.2) 
+      minFrequency =0.2;
+
+    slide = -0.15 - random() * 0.2;			
+
+    if(random() < 0.33)
+    {
+      startFrequency = random() * 0.6;
+      minFrequency = random() * 0.1;
+      slide = -0.35 - random() * 0.3;
+    }
+
+    if(random() < 0.5) 
+    {
+      squareDuty = random() * 0.5;
+      dutySweep = random() * 0.2;
+    }
+    else
+    {
+      squareDuty = 0.4 + random() * 0.5;
+      dutySweep =- random() * 0.7;	
+    }
+
+    sustainTime = 0.1 + random() * 0.2;
+    decayTime = random() * 0.4;
+    if(random() < 0.5) sustainPunch = random() * 0.3;
+
+    if(random() < 0.33)
+    {
+      flangerOffset = random() * 0.2;
+      flangerSweep = -random() * 0.2;
+    }
+
+    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
+  }
+
+  void BfxrParams::generateExplosion()
+  {
+    generateExplosion(DefaultRandom());
+  }
+
+  void BfxrParams::generateExplosion(Random& random)
+  {
+    resetParams();
+    waveType = WaveType::Noise;
+
+    if(random() < 0.5)
+    {
+      startFrequency = 0.1 + random() * 0.4;
+      slide = -0.1 + random() * 0.4;
+    }
+    else
+    {
+      startFrequency = 0.2 + random() * 0.7;
+      slide = -0.2 - random() * 0.2;
+    }
+
+    startFrequency = startFrequency * startFrequency;
+
+    if(random() < 0.2) slide = 0.0;
+    if(random() < 0.33) repeatSpeed = 0.3 + random() * 0.5;
+
+    sustainTime = 0.1 + random() * 0.3;
+    decayTime = random() * 0.5;
+    sustainPunch = 0.2 + random() * 0.6;
+
+    if(random() < 0.5)
+    {
+      flangerOffset = -0.3 + random() * 0.9;
+      flangerSweep = -random() * 0.3;
+    }
+
+    if(random() < 0.33)
+    {
+      changeSpeed = 0.6 + random() * 0.3;
+      changeAmount = 0.8 - random() * 1.6;
+    }
+  }
+
+  void BfxrParams::generatePowerup()
+  {
+    generatePowerup(DefaultRandom());
+  }
+
+  void BfxrParams::generatePowerup(Random& random)
+  {
+    resetParams();
+
+    if(random() < 0.5) waveType = WaveType::Saw;
+    else 					squareDuty = random() * 0.6;
+
+    if(random() < 0.5)
+    {
+      startFrequency = 0.2 + random() * 0.3;
+      slide = 0.1 + random() * 0.4;
+      repeatSpeed = 0.4 + random() * 0.4;
+    }
+    else
+    {
+      startFrequency = 0.2 + random() * 0.3;
+      slide = 0.05 + random() * 0.2;
+
+      if(random() < 0.5)
+      {
+        vibratoDepth = random() * 0.7;
+        vibratoSpeed = random() * 0.6;
+      }
+    }
+
+    sustainTime = random() * 0.4;
+    decayTime = 0.1 + random() * 0.4;
+  }
+
+  void BfxrParams::generateHitHurt()
+  {
+    generateHitHurt(DefaultRandom());
+  }
+
+  void BfxrParams::generateHitHurt(Random& random)
+  {
+    resetParams();
+
+    const auto wt = static_cast<unsigned int>(random() * 3);
+    switch(wt) {
+      case 0: waveType = WaveType::Square; break;
+      case 1: waveType = WaveType::Saw; break;
+      case 2: waveType = WaveType::Noise; break;
+    }
+    if(waveType == WaveType::Square) 
+      squareDuty = random() * 0.6;
+
+    startFrequency = 0.2 + random() * 0.6;
+    slide = -0.3 - random() * 0.4;
+
+    sustainTime = random() * 0.1;
+    decayTime = 0.1 + random() * 0.2;
+
+    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
+  }
+
+  void BfxrParams::generateJump()
+  {
+    generateJump(DefaultRandom());
+  }
+
+  void BfxrParams::generateJump(Random& random)
+  {
+    resetParams();
+
+    waveType = WaveType::Square;
+    squareDuty = random() * 0.6;
+    startFrequency = 0.3 + random() * 0.3;
+    slide = 0.1 + random() * 0.2;
+
+    sustainTime = 0.1 + random() * 0.3;
+    decayTime = 0.1 + random() * 0.2;
+
+    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
+    if(random() < 0.5) lpFilterCutoff = 1.0 - random() * 0.6;
+  }
+
+  void BfxrParams::generateBlipSelect()
+  {
+    generateBlipSelect(DefaultRandom());
+  }
+
+  void BfxrParams::generateBlipSelect(Random& random)
+  {
+    resetParams();
+
+    waveType = (random() < 0.5)? WaveType::Square : WaveType::Saw;
+    if(waveType == WaveType::Square) 
+      squareDuty = random() * 0.6;
+
+    startFrequency =0.2 + random() * 0.4;
+
+    sustainTime = 0.1 + random() * 0.1;
+    decayTime = random() * 0.2;
+    hpFilterCutoff = 0.1;
+  }
+
+  void BfxrParams::resetParams()
+  {
+    waveType = WaveType::Square;
+#define ONVAR(v) do { v =BFXR_PARAM_##v##_DEF; v##_locked = false; } while(false)
+    ALLVALUES
+#undef ONVAR
+      masterVolume_locked = true;
+  }
+
+  void BfxrParams::mutate(double mutation)
+  {
+    mutate(DefaultRandom(), mutation);
+  }
+
+  void BfxrParams::mutate(Random& random, double mutation)
+  {			
+    // should waveType be mutated... I dont think so
+#define ONVAR(param) do \
+    {\
+      if (!param##_locked)\
+      {\
+        if (random()<0.5)\
+        {\
+          param =param + random()*mutation*2 - mutation;\
+        }\
+      }\
+    } while(false)
+    ALLVALUES
+#undef ONVAR
+  }
+
+  void BfxrParams::randomize()
+  {
+    randomize(DefaultRandom());
+  }
+
+  void BfxrParams::randomize(Random& random)
+  {
+#define ONVAR(param) do \
+    {\
+      if (!param##_locked)\
+      {\
+        const auto min = BFXR_PARAM_##param##_MIN;\
+        const auto max = BFXR_PARAM_##param##_MAX;\
+        const auto r = pow(random(), BFXR_PARAM_##param##_RANDOM_POWER);\
+        param =min  + (max-min)*r;\
+      }\
+    } while(false)
+    ALLVALUES
+#undef ONVAR
+
+      if (!waveType_locked)
       {
-        vibratoDepth = random() * 0.7;
-        vibratoSpeed = random() * 0.6;
+        waveType = static_cast<WaveType>(static_cast<unsigned int>(random() * static_cast<int>(WaveType::COUNT)));
+      }
+
+    if (!repeatSpeed_locked)
+    {
+      if (random()<0.5)
+        repeatSpeed =0;
+    }
+
+    if (!slide_locked)
+    {
+      auto r=random()*2-1;
+      r=pow(r,5);
+      slide =r;
+    }
+    if (!deltaSlide_locked)
+    {
+      auto r=random()*2-1;
+      r=pow(r,3);
+      deltaSlide =r;
+    }
+
+    if (!minFrequency_locked)
+      minFrequency =0;
+
+    if (!startFrequency_locked)
+      startFrequency =  	(random() < 0.5) ? pow(random()*2-1, 2) : (pow(random() * 0.5, 3) + 0.5);
+
+    if ((!sustainTime_locked) && (!decayTime_locked))
+    {
+      if(attackTime + sustainTime + decayTime < 0.2)
+      {
+        sustainTime = 0.2 + random() * 0.3;
+        decayTime = 0.2 + random() * 0.3;
+      }
+    }
+
+    if (!slide_locked)
+    {
+      if((startFrequency > 0.7 && slide > 0.2) || (startFrequency < 0.2 && slide < -0.05)) 
+      {
+        slide = -slide;
+      }
+    }
+
+    if (!lpFilterCutoffSweep_locked)
+    {
+      if(lpFilterCutoff < 0.1 && lpFilterCutoffSweep < -0.05) 
+      {
+        lpFilterCutoffSweep = -lpFilterCutoffSweep;
+      }
+    }
+  }
+
+  std::string BfxrParams::serialize() const
+  {
+    // 17 digits so the values survive the round trip, the flash version
+    // wrote 4 decimals but reads any number
+    char buffer[32];
+    std::string str = std::to_string(static_cast<int>(waveType));
+#define ONVAR(param) do \
+    {\
+      std::snprintf(buffer, sizeof(buffer), ",%.17g", param);\
+      str += buffer;\
+    } while(false)
+    ALLVALUES
+#undef ONVAR
+
+    if(waveType_locked) str += ",waveType";
+#define ONVAR(param) do { if(param##_locked) str += "," #param; } while(false)
+    ALLVALUES
+#undef ONVAR
+    return str;
+  }
+
+  bool BfxrParams::deserialize(const std::string& str)
+  {
+    BfxrParams params;
+    params.setAllLocked(false);
+
+    const char* p = str.c_str();
+    char* end = nullptr;
+
+    // flash writes the wave type as a number with decimals too
+    const double wave = std::strtod(p, &end);
+    if(end == p || wave < 0 || wave >= static_cast<int>(WaveType::COUNT) || wave != std::floor(wave))
+    {
+      return false;
+    }
+    params.waveType = static_cast<WaveType>(static_cast<int>(wave));
+    p = end;
+
+#define ONVAR(param) do \
+    {\
+      if(*p != ',') return false;\
+      p += 1;\
+      params.param = std::strtod(p, &end);\
+      if(end == p) return false;\
+      /* also false for nan */\
+      if(!(params.param >= BFXR_PARAM_##param##_MIN && params.param <= BFXR_PARAM_##param##_MAX)) return false;\
+      p = end;\
+    } while(false)
+    ALLVALUES
+#undef ONVAR
+
+    while(*p == ',')
+    {
+      p += 1;
+      const char* name = p;
+      while(*p != ',' && *p != '\0' && !std::isspace(static_cast<unsigned char>(*p))) p += 1;
+      const std::string locked(name, p);
+
+      // names we don't know are ignored like the flash version does
+      if(locked == "waveType") params.waveType_locked = true;
+#define ONVAR(param) do { if(locked == #param) params.param##_locked = true; } while(false)
+      ALLVALUES
+#undef ONVAR
+    }
+
+    while(std::isspace(static_cast<unsigned char>(*p))) p += 1;
+    if(*p != '\0')
+    {
+      return false;
+    }
+
+    *this = params;
+    return true;
+  }
+} // end of sfxr param
+
+
+namespace bfxr
+{
+  namespace detail
+  {
+    // The phase of each of the 8 sub-samples and the parameters the
+    // oscillator needs, gathered by the synth before calling the oscillator
+    template<typename Real>
+    struct OscillatorInput
+    {
+      Real phase[8];
+      Real period;
+      int overtones;
+      Real overtoneFalloff;
+      Real squareDuty;
+    };
+
+#ifdef BFXR_SIMD_X86
+#ifdef __GNUC__
+    // the generic oscillator passes vectors around before it is flattened into
+    // the target specific functions, gcc warns about the abi of those calls when
+    // the translation unit is finished so this can't be popped
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+    template<typename Real>
+    struct Sse2Ops;
+
+    template<>
+    struct Sse2Ops<double>
+    {
+      typedef double Scalar;
+      typedef __m128d Vector;
+      enum { Width = 2 };
+
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Set(double d) { return _mm_set1_pd(d); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Load(const double* p) { return _mm_loadu_pd(p); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE void Store(double* p, Vector v) { _mm_storeu_pd(p, v); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Add(Vector a, Vector b) { return _mm_add_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Sub(Vector a, Vector b) { return _mm_sub_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Mul(Vector a, Vector b) { return _mm_mul_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Div(Vector a, Vector b) { return _mm_div_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Less(Vector a, Vector b) { return _mm_cmplt_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Greater(Vector a, Vector b) { return _mm_cmpgt_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Select(Vector mask, Vector a, Vector b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Abs(Vector a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+      // only valid for positive values below 2^31, which phases always are
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Floor(Vector a) { return _mm_cvtepi32_pd(_mm_cvttpd_epi32(a)); }
+      // int() of a double, valid below 2^31
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Trunc(Vector a) { return _mm_cvtepi32_pd(_mm_cvttpd_epi32(a)); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector GreaterEqual(Vector a, Vector b) { return _mm_cmpge_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Equal(Vector a, Vector b) { return _mm_cmpeq_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector NotEqual(Vector a, Vector b) { return _mm_cmpneq_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector And(Vector a, Vector b) { return _mm_and_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Or(Vector a, Vector b) { return _mm_or_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector AndNot(Vector a, Vector b) { return _mm_andnot_pd(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE bool Any(Vector mask) { return _mm_movemask_pd(mask) != 0; }
+    };
+
+    template<>
+    struct Sse2Ops<float>
+    {
+      typedef float Scalar;
+      typedef __m128 Vector;
+      enum { Width = 4 };
+
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Set(float d) { return _mm_set1_ps(d); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Load(const float* p) { return _mm_loadu_ps(p); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE void Store(float* p, Vector v) { _mm_storeu_ps(p, v); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Add(Vector a, Vector b) { return _mm_add_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Sub(Vector a, Vector b) { return _mm_sub_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Mul(Vector a, Vector b) { return _mm_mul_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Div(Vector a, Vector b) { return _mm_div_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Less(Vector a, Vector b) { return _mm_cmplt_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Greater(Vector a, Vector b) { return _mm_cmpgt_ps(a, b); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Select(Vector mask, Vector a, Vector b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Abs(Vector a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+      // only valid for positive values below 2^31, which phases always are
+      BFXR_TARGET_SSE2 static BFXR_SIMD_INLINE Vector Floor(Vector a) { return _mm_cvtepi32_ps(_mm_cvttps_epi32(a)); }
+    };
+
+    template<typename Real>
+    struct Avx2Ops;
+
+    template<>
+    struct Avx2Ops<double>
+    {
+      typedef double Scalar;
+      typedef __m256d Vector;
+      enum { Width = 4 };
+
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Set(double d) { return _mm256_set1_pd(d); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Load(const double* p) { return _mm256_loadu_pd(p); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE void Store(double* p, Vector v) { _mm256_storeu_pd(p, v); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Sub(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Mul(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Div(Vector a, Vector b) { return _mm256_div_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Less(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Greater(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Select(Vector mask, Vector a, Vector b) { return _mm256_blendv_pd(b, a, mask); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Abs(Vector a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Floor(Vector a) { return _mm256_floor_pd(a); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Trunc(Vector a) { return _mm256_round_pd(a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector GreaterEqual(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Equal(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_EQ_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector NotEqual(Vector a, Vector b) { return _mm256_cmp_pd(a, b, _CMP_NEQ_UQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector And(Vector a, Vector b) { return _mm256_and_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Or(Vector a, Vector b) { return _mm256_or_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector AndNot(Vector a, Vector b) { return _mm256_andnot_pd(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE bool Any(Vector mask) { return _mm256_movemask_pd(mask) != 0; }
+    };
+
+    template<>
+    struct Avx2Ops<float>
+    {
+      typedef float Scalar;
+      typedef __m256 Vector;
+      enum { Width = 8 };
+
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Set(float d) { return _mm256_set1_ps(d); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Load(const float* p) { return _mm256_loadu_ps(p); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE void Store(float* p, Vector v) { _mm256_storeu_ps(p, v); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Sub(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Mul(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Div(Vector a, Vector b) { return _mm256_div_ps(a, b); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Less(Vector a, Vector b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Greater(Vector a, Vector b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Select(Vector mask, Vector a, Vector b) { return _mm256_blendv_ps(b, a, mask); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Abs(Vector a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+      BFXR_TARGET_AVX2 static BFXR_SIMD_INLINE Vector Floor(Vector a) { return _mm256_floor_ps(a); }
+    };
+
+    // fmod() for positive whole numbers, exact as long as they are below 2^53
+    template<typename Ops>
+    BFXR_SIMD_INLINE typename Ops::Vector Mod(const typename Ops::Vector& a, const typename Ops::Vector& b)
+    {
+      return Ops::Sub(a, Ops::Mul(Ops::Floor(Ops::Div(a, b)), b));
+    }
+
+    // The fast sin approximation of the scalar oscillator, phase is in 0-1
+    template<typename Ops>
+    BFXR_SIMD_INLINE typename Ops::Vector SinApprox(const typename Ops::Vector& phase)
+    {
+      typedef typename Ops::Vector V;
+      const V zero = Ops::Set(0.0);
+      const V pos = Ops::Select(
+          Ops::Greater(phase, Ops::Set(0.5)),
+          Ops::Mul(Ops::Sub(phase, Ops::Set(1.0)), Ops::Set(6.28318531)),
+          Ops::Mul(phase, Ops::Set(6.28318531)));
+      const V linear = Ops::Mul(Ops::Set(1.27323954), pos);
+      const V square = Ops::Mul(Ops::Mul(Ops::Set(.405284735), pos), pos);
+      const V s = Ops::Select(Ops::Less(pos, zero), Ops::Add(linear, square), Ops::Sub(linear, square));
+      const V negative = Ops::Add(Ops::Mul(Ops::Set(.225), Ops::Sub(Ops::Mul(s, Ops::Sub(zero, s)), s)), s);
+      const V positive = Ops::Add(Ops::Mul(Ops::Set(.225), Ops::Sub(Ops::Mul(s, s), s)), s);
+      return Ops::Select(Ops::Less(s, zero), negative, positive);
+    }
+
+    // One overtone of the waves that doesn't depend on any noise state, pos is
+    // tempphase / period. Does the same operations in the same order as
+    // BfxrSynth::oscillate() so the result is identical to the scalar oscillator.
+    template<typename Ops, WaveType W>
+    BFXR_SIMD_INLINE typename Ops::Vector WaveValue(const typename Ops::Vector& pos, const typename Ops::Vector& tempphase,
+        const typename Ops::Vector& period, const typename Ops::Vector& squareDuty)
+    {
+      typedef typename Ops::Vector V;
+      const V one = Ops::Set(1.0);
+      switch(W)
+      {
+        case WaveType::Square:
+          return Ops::Select(Ops::Less(pos, squareDuty), Ops::Set(0.5), Ops::Set(-0.5));
+        case WaveType::Saw:
+          return Ops::Sub(one, Ops::Mul(pos, Ops::Set(2.0)));
+        case WaveType::Sin:
+          return SinApprox<Ops>(pos);
+        case WaveType::Triangle:
+          return Ops::Sub(Ops::Abs(Ops::Sub(one, Ops::Mul(pos, Ops::Set(2.0)))), one);
+        case WaveType::Whistle:
+          {
+            const V whistle = Ops::Div(Mod<Ops>(Ops::Mul(tempphase, Ops::Set(20.0)), period), period);
+            const V value = Ops::Mul(Ops::Set(0.75), SinApprox<Ops>(pos));
+            return Ops::Add(value, Ops::Mul(Ops::Set(0.25), SinApprox<Ops>(whistle)));
+          }
+        case WaveType::Breaker:
+          return Ops::Sub(Ops::Abs(Ops::Sub(one, Ops::Mul(Ops::Mul(pos, pos), Ops::Set(2.0)))), one);
+        default:
+          assert(0 && "wave can't be vectorized");
+          return Ops::Set(0.0);
+      }
+    }
+
+    // Vectorized version of BfxrSynth::oscillate() for the waves that doesn't
+    // depend on any noise state, one sub-sample per lane
+    template<typename Ops, WaveType W>
+    BFXR_SIMD_INLINE void Oscillate(const OscillatorInput<typename Ops::Scalar>& in, typename Ops::Scalar* out)
+    {
+      typedef typename Ops::Vector V;
+      const V period = Ops::Set(in.period);
+      const V squareDuty = Ops::Set(in.squareDuty);
+
+      for(int j = 0; j < 8; j += Ops::Width)
+      {
+        // same phase accumulation as the scalar oscillator
+        const V basephase = Mod<Ops>(Ops::Load(in.phase + j), period);
+        V tempphase = Ops::Set(0.0);
+        V sample = Ops::Set(0.0);
+        typename Ops::Scalar overtonestrength = 1;
+        for(int k = 0; k <= in.overtones; k++)
+        {
+          tempphase = Ops::Add(tempphase, basephase);
+          tempphase = Ops::Select(Ops::Less(tempphase, period), tempphase, Ops::Sub(tempphase, period));
+          const V pos = Ops::Div(tempphase, period);
+          const V value = WaveValue<Ops, W>(pos, tempphase, period, squareDuty);
+          sample = Ops::Add(sample, Ops::Mul(Ops::Set(overtonestrength), value));
+          overtonestrength *= (1 - in.overtoneFalloff);
+        }
+        Ops::Store(out + j, sample);
+      }
+    }
+
+    template<typename Real, WaveType W>
+    BFXR_TARGET_SSE2 BFXR_FLATTEN void OscillateSse2(const OscillatorInput<Real>& in, Real* out)
+    {
+      Oscillate<Sse2Ops<Real>, W>(in, out);
+    }
+
+    template<typename Real, WaveType W>
+    BFXR_TARGET_AVX2 BFXR_FLATTEN void OscillateAvx2(const OscillatorInput<Real>& in, Real* out)
+    {
+      Oscillate<Avx2Ops<Real>, W>(in, out);
+    }
+
+    template<typename Real, WaveType W>
+    OscillatorFunction<Real> GetOscillator(SimdLevel level)
+    {
+      switch(level)
+      {
+        case SimdLevel::Sse2: return &OscillateSse2<Real, W>;
+        case SimdLevel::Avx2: return &OscillateAvx2<Real, W>;
+        default: return nullptr;
+      }
+    }
+
+    template<typename Ops>
+    BFXR_SIMD_INLINE void Mix(float* out, const float* in, float volume, std::size_t n)
+    {
+      typedef typename Ops::Vector V;
+      const V gain = Ops::Set(volume);
+      std::size_t i = 0;
+      for(; i + Ops::Width <= n; i += Ops::Width)
+      {
+        Ops::Store(out + i, Ops::Add(Ops::Load(out + i), Ops::Mul(Ops::Load(in + i), gain)));
+      }
+      for(; i < n; i += 1)
+      {
+        out[i] += in[i] * volume;
+      }
+    }
+
+    BFXR_TARGET_SSE2 BFXR_FLATTEN void MixSse2(float* out, const float* in, float volume, std::size_t n)
+    {
+      Mix<Sse2Ops<float>>(out, in, volume, n);
+    }
+
+    BFXR_TARGET_AVX2 BFXR_FLATTEN void MixAvx2(float* out, const float* in, float volume, std::size_t n)
+    {
+      Mix<Avx2Ops<float>>(out, in, volume, n);
+    }
+
+#endif // BFXR_SIMD_X86
+
+    void FloatToS16Scalar(const float* in, std::int16_t* out, std::size_t n)
+    {
+      for(std::size_t i = 0; i < n; i += 1)
+      {
+        const float sample = std::min(std::max(in[i], -1.0f), 1.0f);
+        out[i] = static_cast<std::int16_t>(32767.0f * sample);
+      }
+    }
+
+#ifdef BFXR_SIMD_X86
+    // Truncates like the cast, the saturating pack never kicks in since the
+    // samples are already clamped
+    BFXR_TARGET_SSE2 void FloatToS16Sse2(const float* in, std::int16_t* out, std::size_t n)
+    {
+      const __m128 low = _mm_set1_ps(-1.0f);
+      const __m128 high = _mm_set1_ps(1.0f);
+      const __m128 scale = _mm_set1_ps(32767.0f);
+      std::size_t i = 0;
+      for(; i + 8 <= n; i += 8)
+      {
+        const __m128 a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), low), high), scale);
+        const __m128 b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), low), high), scale);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+      }
+      FloatToS16Scalar(in + i, out + i, n - i);
+    }
+
+    BFXR_TARGET_AVX2 void FloatToS16Avx2(const float* in, std::int16_t* out, std::size_t n)
+    {
+      const __m256 low = _mm256_set1_ps(-1.0f);
+      const __m256 high = _mm256_set1_ps(1.0f);
+      const __m256 scale = _mm256_set1_ps(32767.0f);
+      std::size_t i = 0;
+      for(; i + 16 <= n; i += 16)
+      {
+        const __m256 a = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i), low), high), scale);
+        const __m256 b = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(in + i + 8), low), high), scale);
+        // the pack works within 128 bit lanes, the permute puts them in order
+        const __m256i packed = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+      }
+      FloatToS16Scalar(in + i, out + i, n - i);
+    }
+#endif // BFXR_SIMD_X86
+
+    void MixScalar(float* out, const float* in, float volume, std::size_t n)
+    {
+      for(std::size_t i = 0; i < n; i += 1)
+      {
+        out[i] += in[i] * volume;
+      }
+    }
+
+    MixFunction GetMixFunction(SimdLevel level)
+    {
+#ifdef BFXR_SIMD_X86
+      switch(level)
+      {
+        case SimdLevel::Sse2: return &MixSse2;
+        case SimdLevel::Avx2: return &MixAvx2;
+        default: return &MixScalar;
+      }
+#else
+      (void)level;
+      return &MixScalar;
+#endif
+    }
+
+    // Returns the vectorized oscillator for the wave, or null if the scalar
+    // oscillator should be used
+    template<typename Real>
+    OscillatorFunction<Real> GetOscillator(SimdLevel level, WaveType wave)
+    {
+#ifdef BFXR_SIMD_X86
+      switch(wave)
+      {
+        case WaveType::Square: return GetOscillator<Real, WaveType::Square>(level);
+        case WaveType::Saw: return GetOscillator<Real, WaveType::Saw>(level);
+        case WaveType::Sin: return GetOscillator<Real, WaveType::Sin>(level);
+        case WaveType::Triangle: return GetOscillator<Real, WaveType::Triangle>(level);
+        case WaveType::Whistle: return GetOscillator<Real, WaveType::Whistle>(level);
+        case WaveType::Breaker: return GetOscillator<Real, WaveType::Breaker>(level);
+        default: return nullptr;
+      }
+#else
+      (void)level;
+      (void)wave;
+      return nullptr;
+#endif
+    }
+
+    SimdLevel DetectSimdLevelOnce()
+    {
+#ifdef BFXR_SIMD_X86
+#ifdef _MSC_VER
+      int info[4];
+      __cpuid(info, 0);
+      const int highest = info[0];
+      __cpuid(info, 1);
+      const bool sse2 = (info[3] & (1 << 26)) != 0;
+      // avx2 also needs the os to save the ymm registers
+      const bool osxsave = (info[2] & (1 << 27)) != 0;
+      bool avx2 = false;
+      if(highest >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
+      {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
       }
+#else
+      __builtin_cpu_init();
+      const bool sse2 = __builtin_cpu_supports("sse2");
+      const bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+      if(avx2) return SimdLevel::Avx2;
+      if(sse2) return SimdLevel::Sse2;
+#endif
+      return SimdLevel::Scalar;
+    }
+  }
+
+  SimdLevel DetectSimdLevel()
+  {
+    static const SimdLevel level = detail::DetectSimdLevelOnce();
+    return level;
+  }
+}
+
+
+
+
+namespace bfxr
+{
+  constexpr double PI = 3.14;
+
+  double Abs(double d) {
+    if(d > 0) return d;
+    else return -d;
+  }
+
+  // PolyBLEP residual of a step from -1 to 1 at t=0, where t is the position
+  // in the period and dt the phase increment per sample, both in periods
+  double PolyBlep(double t, double dt)
+  {
+    if(t < dt)
+    {
+      const double x = t / dt;
+      return x + x - x * x - 1.0;
+    }
+    else if(t > 1.0 - dt)
+    {
+      const double x = (t - 1.0) / dt;
+      return x * x + x + x + 1.0;
     }
+    return 0.0;
+  }
+
+  // PolyBLAMP residual of a corner where the slope increases by 1 per sample
+  double PolyBlamp(double t, double dt)
+  {
+    if(t < dt)
+    {
+      const double x = t / dt - 1.0;
+      return -x * x * x / 3.0;
+    }
+    else if(t > 1.0 - dt)
+    {
+      const double x = (t - 1.0) / dt + 1.0;
+      return x * x * x / 3.0;
+    }
+    return 0.0;
+  }
+
+  // Wraps a position in the period to 0-1 after an offset was subtracted
+  double WrapPeriod(double t)
+  {
+    return t < 0.0 ? t + 1.0 : t;
+  }
+
+  // Fast approximations used when RenderSettings::fastMath is set. The error
+  // bounds are measured over the ranges the synth calls them with.
+
+  // pow(x, y) for x >= 0 and 0 <= y <= 1, relative error below 2e-7
+  double FastPow(double x, double y)
+  {
+    if(x <= 0.0) return 0.0;
+
+    // log2(x) from the exponent and log2 of the mantissa m in [1, 2) using
+    // the series of atanh((m-1)/(m+1)) which converges fast as t <= 1/3
+    std::uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    const int exponent = static_cast<int>((bits >> 52) & 0x7ff) - 1023;
+    bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+    double m;
+    std::memcpy(&m, &bits, sizeof(m));
+    const double t = (m - 1.0) / (m + 1.0);
+    const double t2 = t * t;
+    const double series = t * (1.0 + t2 * (1.0/3.0 + t2 * (1.0/5.0 + t2 * (1.0/7.0 + t2 * (1.0/9.0 + t2 * (1.0/11.0))))));
+    double e = y * (exponent + series * 2.88539008177792681); // 2/ln(2)
+
+    // 2^e, from 2^round(e) in the exponent bits and 2^f with f in [-0.5, 0.5]
+    if(e < -1020.0) return 0.0;
+    const double whole = std::floor(e + 0.5);
+    const double f = (e - whole) * 0.693147180559945309; // ln(2)
+    const double p = 1.0 + f * (1.0 + f * (1.0/2.0 + f * (1.0/6.0 + f * (1.0/24.0 + f * (1.0/120.0 + f * (1.0/720.0 + f * (1.0/5040.0)))))));
+    bits = static_cast<std::uint64_t>(static_cast<int>(whole) + 1023) << 52;
+    double scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+  }
+
+  // sin(x) for x in [-pi/2, pi/2], absolute error below 6e-8 and relative
+  // error below 6e-8 as well since the error shrinks faster than x
+  double FastSinHalfPeriod(double x)
+  {
+    const double x2 = x * x;
+    return x * (1.0 + x2 * (-1.0/6.0 + x2 * (1.0/120.0 + x2 * (-1.0/5040.0 + x2 * (1.0/362880.0 + x2 * (-1.0/39916800.0))))));
+  }
 
-    sustainTime = random() * 0.4;
-    decayTime = 0.1 + random() * 0.4;
+  // sin(x) for any x, absolute error below 6e-8 (plus the error of reducing
+  // x to one period, which grows with x)
+  double FastSin(double x)
+  {
+    const double pi = 3.14159265358979323846;
+    x -= 2.0 * pi * std::floor(x * (0.5 / pi) + 0.5);
+    if(x > 0.5 * pi) x = pi - x;
+    else if(x < -0.5 * pi) x = -pi - x;
+    return FastSinHalfPeriod(x);
   }
 
-  void BfxrParams::generateHitHurt()
+  // tan(x) for x in [0, pi), relative error below 2e-7. The cosine is taken
+  // as a sine so it stays accurate next to the pole
+  double FastTan(double x)
   {
-    resetParams();
+    const double pi = 3.14159265358979323846;
+    if(x > 0.5 * pi) x -= pi;
+    return FastSinHalfPeriod(x) / FastSinHalfPeriod(0.5 * pi - std::abs(x));
+  }
 
-    const auto wt = static_cast<unsigned int>(random() * 3);
-    switch(wt) {
-      case 0: waveType = WaveType::Square; break;
-      case 1: waveType = WaveType::Saw; break;
-      case 2: waveType = WaveType::Noise; break;
-    }
-    if(waveType == WaveType::Square) 
-      squareDuty = random() * 0.6;
+  BfxrSynth::BfxrSynth(const BfxrParams& p, const RenderSettings& settings)
+    : _random(settings.seed)
+    , _pinkNumber(_random)
+    , _settings(settings)
+    , _params(p)
+  {
+    _finished = false;
+    _sampleIndex = 0;
 
-    startFrequency = 0.2 + random() * 0.6;
-    slide = -0.3 - random() * 0.4;
+    _rateRatio = static_cast<double>(ReferenceSampleRate) / _settings.sampleRate;
 
-    sustainTime = random() * 0.1;
-    decayTime = 0.1 + random() * 0.2;
+    // Oversampling is rounded up to the next supported factor
+    _holdShift = 0;
+    while(_holdShift < 3 && (8 >> (_holdShift + 1)) >= _settings.oversampling)
+    {
+      _holdShift += 1;
+    }
 
-    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
+    reset(true);
   }
 
-  void BfxrParams::generateJump()
+  void BfxrSynth::start(const BfxrParams& p, std::uint64_t seed)
   {
-    resetParams();
+    _params = p;
+    _settings.seed = seed;
+    _random.Seed(seed);
+    _pinkNumber = PinkNoise(_random);
+    _finished = false;
+    _sampleIndex = 0;
+
+    reset(true);
+  }
 
-    waveType = WaveType::Square;
-    squareDuty = random() * 0.6;
-    startFrequency = 0.3 + random() * 0.3;
-    slide = 0.1 + random() * 0.2;
+  std::size_t BfxrSynth::flangerBufferSize(int sampleRate)
+  {
+    // the buffer needs to hold the longest offset at this rate
+    const double rate = static_cast<double>(sampleRate) / ReferenceSampleRate;
+    std::size_t size = 1024;
+    while(size <= static_cast<std::size_t>(1023 * rate)) size *= 2;
+    return size;
+  }
 
-    sustainTime = 0.1 + random() * 0.3;
-    decayTime = 0.1 + random() * 0.2;
+  void BfxrSynth::setSimdLevel(SimdLevel level)
+  {
+    _settings.simdLevel = level;
+    _oscillator = detail::GetOscillator<double>(_settings.simdLevel, _waveType);
+    _oscillatorFloat = detail::GetOscillator<float>(_settings.simdLevel, _waveType);
+  }
 
-    if(random() < 0.5) hpFilterCutoff = random() * 0.3;
-    if(random() < 0.5) lpFilterCutoff = 1.0 - random() * 0.6;
+  double BfxrSynth::synthOneSample()
+  {
+    // through renderBlock so the precision and the position are respected
+    double sample = 0.0;
+    renderBlock(&sample, 1);
+    return sample;
   }
 
-  void BfxrParams::generateBlipSelect()
+  template<typename Real, WaveType W, bool Filters, bool Flanger, bool Vibrato, bool Overtones>
+  void BfxrSynth::synthBlock(Real* out, std::size_t n)
   {
-    resetParams();
+    // The filter state is kept in the precision of the kernel while rendering
+    Real lpFilterPos = static_cast<Real>(_lpFilterPos);
+    Real lpFilterDeltaPos = static_cast<Real>(_lpFilterDeltaPos);
+    Real hpFilterPos = static_cast<Real>(_hpFilterPos);
+    const detail::OscillatorFunction<Real> oscillator = getOscillator<Real>();
+
+    // The limits of the per sample values, scaled like reset() scales them
+    const double lpFilterMaxCutoff = 0.1 * _rateRatio * _rateRatio;
+    const double hpFilterMinCutoff = 0.00001 * _rateRatio;
+    const double hpFilterMaxCutoff = 0.1 * _rateRatio;
+    const double bitcrushMaxFreq = _rateRatio;
+    const int flangerMask = static_cast<int>(_flangerBuffer.size()) - 1;
+    const int flangerMaxOffset = static_cast<int>(1023 / _rateRatio);
+    const bool fastMath = _settings.fastMath;
+
+    for(std::size_t i=0; i<n; i+=1)
+    {
+      // Nothing but silence is left once the sound is muted or finished
+      if (_finished || _muted) 
+      {
+        _finished = true;
+        std::fill(out + i, out + n, static_cast<Real>(0));
+        break;
+      }
 
-    waveType = (random() < 0.5)? WaveType::Square : WaveType::Saw;
-    if(waveType == WaveType::Square) 
-      squareDuty = random() * 0.6;
+      // Repeats every _repeatLimit times, partially resetting the sound parameters
+      if(_repeatLimit != 0)
+      {
+        if(++_repeatTime >= _repeatLimit)
+        {
+          _repeatTime = 0;
+          reset(false);
+        }
+      }
 
-    startFrequency =0.2 + random() * 0.4;
+      _changePeriodTime++;
+      if (_changePeriodTime>=_changePeriod)
+      {				
+        _changeTime=0;
+        _changeTime2=0;
+        _changePeriodTime=0;
+        if (_changeReached)
+        {
+          _period /= _changeAmount;
+          _changeReached=false;
+        }
+        if (_changeReached2)
+        {
+          _period /= _changeAmount2;
+          _changeReached2=false;
+        }
+      }
 
-    sustainTime = 0.1 + random() * 0.1;
-    decayTime = random() * 0.2;
-    hpFilterCutoff = 0.1;
-  }
+      // If _changeLimit is reached, shifts the pitch
+      if(!_changeReached)
+      {
+        if(++_changeTime >= _changeLimit)
+        {
+          _changeReached = true;
+          _period *= _changeAmount;
+        }
+      }
 
-  void BfxrParams::resetParams()
-  {
-    waveType = WaveType::Square;
-#define ONVAR(v) do { v =BFXR_PARAM_##v##_DEF; v##_locked = false; } while(false)
-    ALLVALUES
-#undef ONVAR
-      masterVolume_locked = true;
-  }
+      // If _changeLimit is reached, shifts the pitch
+      if(!_changeReached2)
+      {
+        if(++_changeTime2 >= _changeLimit2)
+        {
+          _period *= _changeAmount2;
+          _changeReached2=true;
+        }
+      }
 
-  void BfxrParams::mutate(double mutation)
-  {			
-    // should waveType be mutated... I dont think so
-#define ONVAR(param) do \
-    {\
-      if (!param##_locked)\
-      {\
-        if (random()<0.5)\
-        {\
-          param =param + random()*mutation*2 - mutation;\
-        }\
-      }\
-    } while(false)
-    ALLVALUES
-#undef ONVAR
+      // Acccelerate and apply slide
+      _slide += _deltaSlide;
+      _period *= _slide;
+
+      // Checks for frequency getting too low, and stops the sound if a minFrequency was set
+      if(_period > _maxPeriod)
+      {
+        _period = _maxPeriod;
+        if(_minFreqency > 0.0) {
+          _muted = true;
+        }										
+      }
+
+      _periodTemp = _period;
+
+      // Applies the vibrato effect
+      if(Vibrato)
+      {
+        _vibratoPhase += _vibratoSpeed;
+        const double vibrato = fastMath ? FastSin(_vibratoPhase) : std::sin(_vibratoPhase);
+        _periodTemp = _period * (1.0 + vibrato * _vibratoAmplitude);
+      }
+
+      _periodTemp = int(_periodTemp);
+      if(_periodTemp < 8) _periodTemp = 8;
+
+      // Sweeps the square duty
+      if (W == WaveType::Square)
+      {
+        _squareDuty += _dutySweep;
+        if(_squareDuty < 0.0) _squareDuty = 0.0;
+        else if (_squareDuty > 0.5) _squareDuty = 0.5;
+      }
+
+      // Moves through the different stages of the volume envelope
+      if(++_envelopeTime > _envelopeLength)
+      {
+        _envelopeTime = 0;
+
+        switch(++_envelopeStage)
+        {
+          case 1: _envelopeLength = _envelopeLength1; break;
+          case 2: _envelopeLength = _envelopeLength2; break;
+        }
+      }
+
+      // Sets the volume based on the position in the envelope
+      switch(_envelopeStage)
+      {
+        case 0: _envelopeVolume = _envelopeTime * _envelopeOverLength0; 									break;
+        case 1: _envelopeVolume = 1.0 + (1.0 - _envelopeTime * _envelopeOverLength1) * 2.0 * _sustainPunch; break;
+        case 2: _envelopeVolume = 1.0 - _envelopeTime * _envelopeOverLength2; 								break;
+        case 3: _envelopeVolume = 0.0; _finished = true; 													break;
+      }
+
+      // Moves the flanger offset
+      if (Flanger)
+      {
+        _flangerOffset += _flangerDeltaOffset;
+        _flangerInt = int(_flangerOffset);
+        if(_flangerInt < 0) 	_flangerInt = -_flangerInt;
+        else if (_flangerInt > flangerMaxOffset) _flangerInt = flangerMaxOffset;
+      }
+
+      // Moves the high-pass filter cutoff
+      if(Filters && _hpFilterDeltaCutoff != 0.0)
+      {
+        _hpFilterCutoff *= _hpFilterDeltaCutoff;
+        if(_hpFilterCutoff < hpFilterMinCutoff) 	_hpFilterCutoff = hpFilterMinCutoff;
+        else if(_hpFilterCutoff > hpFilterMaxCutoff) 		_hpFilterCutoff = hpFilterMaxCutoff;
+      }
+
+      // When the bitcrusher holds its last value this sample is thrown away, and
+      // without filters or a flanger nothing but the phase needs to be kept
+      const bool held = !Filters && !Flanger && !(_bitcrush_phase + _bitcrush_freq > 1);
+
+      Real _subSamples[8];
+      if(held)
+      {
+        const int step = 1 << _holdShift;
+        for(int j= 0; j < 8; j += step)
+        {
+          advancePhase<W>(step);
+        }
+      }
+      else if(_holdShift > 0)
+      {
+        // Fewer band-limited sub-samples, each one held for the filter
+        // steps of the sub-samples it replaces
+        oscillate<W, Overtones, true>(_subSamples);
+      }
+      else if(oscillator != nullptr)
+      {
+        // Cycles through the period, the vectorized waves has no noise to regenerate
+        detail::OscillatorInput<Real> input;
+        for(int j= 0; j < 8; j++)
+        {
+          _phase++;
+          if(_phase >= _periodTemp)
+          {
+            _phase = _phase - _periodTemp;
+          }
+          input.phase[j] = static_cast<Real>(_phase);
+        }
+        input.period = static_cast<Real>(_periodTemp);
+        input.overtones = _overtones;
+        input.overtoneFalloff = static_cast<Real>(_overtoneFalloff);
+        input.squareDuty = static_cast<Real>(_squareDuty);
+        oscillator(input, _subSamples);
+      }
+      else
+      {
+        oscillate<W, Overtones, false>(_subSamples);
+      }
+
+      Real _superSample = 0;
+      for(int j= 0; j < 8 && !held; j++)
+      {
+        Real _sample = _subSamples[j >> _holdShift];
+
+        // Applies the low and high pass filters
+        if (Filters)
+        {
+          const Real lpFilterOldPos = lpFilterPos;
+          _lpFilterCutoff *= _lpFilterDeltaCutoff;
+          if(_lpFilterCutoff < 0.0) _lpFilterCutoff = 0.0;
+          else if(_lpFilterCutoff > lpFilterMaxCutoff) _lpFilterCutoff = lpFilterMaxCutoff;
+
+          if(_lpFilterOn)
+          {
+            lpFilterDeltaPos += (_sample - lpFilterPos) * static_cast<Real>(_lpFilterCutoff);
+            lpFilterDeltaPos *= static_cast<Real>(_lpFilterDamping);
+          }
+          else
+          {
+            lpFilterPos = _sample;
+            lpFilterDeltaPos = 0;
+          }
+
+          lpFilterPos += lpFilterDeltaPos;
+
+          hpFilterPos += lpFilterPos - lpFilterOldPos;
+          hpFilterPos *= static_cast<Real>(1.0 - _hpFilterCutoff);
+          _sample = hpFilterPos;
+        }
+
+        // Applies the flanger effect
+        if (Flanger)
+        {
+          _flangerBuffer[_flangerPos&flangerMask] = _sample;
+          _sample += static_cast<Real>(_flangerBuffer[(_flangerPos - _flangerInt + flangerMask + 1) & flangerMask]);
+          _flangerPos = (_flangerPos + 1) & flangerMask;
+        }
+
+        _superSample += _sample;
+      }
+
+      // Clipping if too loud
+      if(_superSample > 8) 	_superSample = 8;
+      else if(_superSample < -8) 	_superSample = -8;					 				 				
+
+      // Averages out the super samples and applies volumes
+      _superSample = static_cast<Real>(_masterVolume * _envelopeVolume) * _superSample * static_cast<Real>(0.125);				
+
+
+      //BIT CRUSH				
+      _bitcrush_phase+=_bitcrush_freq;
+      if (_bitcrush_phase>1)
+      {
+        _bitcrush_phase=0;
+        _bitcrush_last=_superSample;	 
+      }
+      _bitcrush_freq = std::max(std::min(_bitcrush_freq+_bitcrush_freq_sweep,bitcrushMaxFreq),0.0);
+
+      _superSample=static_cast<Real>(_bitcrush_last); 				
+
+
+
+      //compressor, does nothing when the factor is 1
+
+      if (_compression_factor != 1.0)
+      {
+        if (fastMath)
+        {
+          if (_superSample>0) _superSample = static_cast<Real>(FastPow(_superSample, _compression_factor));
+          else _superSample = -static_cast<Real>(FastPow(-_superSample, _compression_factor));
+        }
+        else if (_superSample>0)
+        {
+          _superSample = std::pow(_superSample,static_cast<Real>(_compression_factor));
+        }
+        else
+        {
+          _superSample = -std::pow(-_superSample,static_cast<Real>(_compression_factor));
+        }
+      }
+
+      if (_muted)
+      {
+        _superSample = 0;
+      }
+
+      out[i] = _superSample;
+    }
+
+    _lpFilterPos = lpFilterPos;
+    _lpFilterDeltaPos = lpFilterDeltaPos;
+    _hpFilterPos = hpFilterPos;
   }
 
-  void BfxrParams::randomize()
+  // Cycles through the period, generating new noise for the noise waves
+  template<WaveType W>
+  void BfxrSynth::advancePhase(int step)
   {
-#define ONVAR(param) do \
-    {\
-      if (!param##_locked)\
-      {\
-        const auto min = BFXR_PARAM_##param##_MIN;\
-        const auto max = BFXR_PARAM_##param##_MAX;\
-        const auto r = pow(random(), BFXR_PARAM_##param##_RANDOM_POWER);\
-        param =min  + (max-min)*r;\
-      }\
-    } while(false)
-    ALLVALUES
-#undef ONVAR
+    _phase += step;
+    if(_phase >= _periodTemp)
+    {
+      _phase = _phase - _periodTemp; // todo: int double operation stored in int hrm...
 
-      if (!waveType_locked)
+      // Generates new random noise for this period
+      if(W == WaveType::Noise) 
+      { 
+        _random.Fill(_noiseBuffer, 32);
+      }
+      else if (W == WaveType::Pink)
       {
-        waveType = static_cast<WaveType>(static_cast<unsigned int>(random() * static_cast<int>(WaveType::COUNT)));
+        _pinkNumber.Fill(_random, _pinkNoiseBuffer, 32);
+      }
+      else if (W == WaveType::OneBitNoise)
+      {
+        // Based on SN76489 periodic "white" noise
+        // http://www.smspower.org/Development/SN76489?sid=ae16503f2fb18070f3f40f2af56807f1#NoiseChannel
+        // This one matches the behaviour of the SN76489 in the BBC Micro.
+        const int feedBit = (_oneBitNoiseState >> 1 & 1) ^ (_oneBitNoiseState & 1);
+        _oneBitNoiseState = _oneBitNoiseState >> 1 | (feedBit << 14);
+        _oneBitNoise = (~_oneBitNoiseState & 1) - 0.5;
+      }
+      else if (W == WaveType::Buzz)
+      {
+        // Based on SN76489 periodic "white" noise
+        // http://www.smspower.org/Development/SN76489?sid=ae16503f2fb18070f3f40f2af56807f1#NoiseChannel
+        // This one doesn't match the behaviour of anything real, but it made a nice sound, so I kept it.
+        const int feedBit = (_buzzState >> 3 & 1) ^ (_buzzState & 1);
+        _buzzState = _buzzState >> 1 | (feedBit << 14);
+        _buzz = (~_buzzState & 1) - 0.5;
       }
+    }
+  }
 
-    if (!repeatSpeed_locked)
+  template<WaveType W, bool Overtones, bool BandLimited, typename Real>
+  void BfxrSynth::oscillate(Real* out)
+  {
+    const int overtones = Overtones ? _overtones : 0;
+    const int count = BandLimited ? 8 >> _holdShift : 8;
+    const int step = BandLimited ? 1 << _holdShift : 1;
+
+    // Overtones above the nyquist frequency only alias, the noise waves are
+    // left alone as they are noisy anyway
+    const bool dropAliasing = BandLimited && W != WaveType::Noise && W != WaveType::Pink
+      && W != WaveType::OneBitNoise && W != WaveType::Buzz;
+
+    for(int j= 0; j < count; j++)
     {
-      if (random()<0.5)
-        repeatSpeed =0;
+      advancePhase<W>(step);
+
+      // The phase of overtone k is (k+1) times the phase of the wave, so it is
+      // accumulated by adding the phase and wrapped by subtracting the period.
+      // Everything is a whole number so this is exactly what fmod() would give
+      const double basephase = _phase < _periodTemp ? _phase : fmod(_phase, _periodTemp);
+      double tempphase = 0;
+
+      double _sample=0;
+      double overtonestrength=1;
+      for (int k=0;k<=overtones;k++)
+      {
+        tempphase += basephase;
+        if(tempphase >= _periodTemp) tempphase -= _periodTemp;
+
+        // Phase increment of this overtone per sub-sample, in periods
+        const double dt = BandLimited ? (k+1) * step / _periodTemp : 0.0;
+        if(dropAliasing && dt >= 0.5)
+        {
+          overtonestrength*=(1-_overtoneFalloff);
+          continue;
+        }
+        // Gets the sample from the oscillator
+        switch(W)
+        {
+          case WaveType::Square:
+            {
+              double value = ((tempphase / _periodTemp) < _squareDuty) ? 0.5 : -0.5;
+              if(BandLimited)
+              {
+                const double t = tempphase / _periodTemp;
+                value += 0.5 * PolyBlep(t, dt) - 0.5 * PolyBlep(WrapPeriod(t - _squareDuty), dt);
+              }
+              _sample += overtonestrength*value;
+              break;
+            }
+          case WaveType::Saw:
+            {
+              double value = 1.0 - (tempphase / _periodTemp) * 2.0;
+              if(BandLimited) value += PolyBlep(tempphase / _periodTemp, dt);
+              _sample += overtonestrength*value;
+              break;
+            }
+          case WaveType::Sin:
+            {								
+              _pos = tempphase / _periodTemp;
+              _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
+              double _tempsample= _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
+              _sample += overtonestrength*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);								
+              break;
+            }
+          case WaveType::Noise:
+            {
+              _sample += overtonestrength*(_noiseBuffer[static_cast<unsigned int>(tempphase * 32 / int(_periodTemp))%32]);
+              break;
+            }
+          case WaveType::Triangle:
+            {						
+              double value = Abs(1-(tempphase / _periodTemp)*2)-1;
+              if(BandLimited)
+              {
+                // the slope goes from 2 to -2 per period at the start and back at the middle
+                const double t = tempphase / _periodTemp;
+                value += 4.0 * dt * (PolyBlamp(WrapPeriod(t - 0.5), dt) - PolyBlamp(t, dt));
+              }
+              _sample += overtonestrength*value;
+              break;
+            }
+          case WaveType::Pink:
+            {						
+              _sample += overtonestrength*(_pinkNoiseBuffer[static_cast<unsigned int>(tempphase * 32 / int(_periodTemp))%32]);
+              break;
+            }
+          case WaveType::Tan:
+            {
+              //detuned
+              const double angle = PI*tempphase/_periodTemp;
+              _sample += (_settings.fastMath ? FastTan(angle) : tan(angle))*overtonestrength;
+              break;
+            }
+          case WaveType::Whistle:
+            {				
+              // Sin wave code
+              _pos = tempphase / _periodTemp;
+              _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
+              double _tempsample = _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
+              double value= 0.75*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);
+              //then whistle (essentially an overtone with frequencyx20 and amplitude0.25
+              if(BandLimited && dt * 20 >= 0.5)
+              {
+                _sample += overtonestrength*value;
+                break;
+              }
+
+              _pos = fmod((tempphase*20) , _periodTemp) / _periodTemp;
+              _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
+              _tempsample = _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
+              value += 0.25*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);
+
+              _sample += overtonestrength*value;//main wave
+
+              break;
+            }
+          case WaveType::Breaker:
+            {	
+              double amp= tempphase/_periodTemp;								
+              double value = Abs(1-amp*amp*2)-1;
+              if(BandLimited)
+              {
+                // the slope drops by 4 per period at the start and rises by
+                // 4*sqrt(2) where the parabola is folded at 1/sqrt(2)
+                value += 4.0 * dt * (1.41421356 * PolyBlamp(WrapPeriod(amp - 0.70710678), dt) - PolyBlamp(amp, dt));
+              }
+              _sample += overtonestrength*value;
+              break;
+            }
+          case WaveType::OneBitNoise: // 1-bit periodic "white" noise
+            {
+              _sample += overtonestrength*_oneBitNoise;
+              break;
+            }
+          case WaveType::Buzz: // 1-bit periodic "buzz" noise
+            {
+              _sample += overtonestrength*_buzz;
+              break;
+            }
+          case WaveType::COUNT:
+            assert(0 && "invalid case");
+            break;
+        }
+        overtonestrength*=(1-_overtoneFalloff);
+
+      }					
+
+      out[j] = static_cast<Real>(_sample);
     }
+  }
 
-    if (!slide_locked)
+  namespace detail
+  {
+    // Picks the kernel specialized for the wave and the effects that are used,
+    // one bool at a time so every combination gets instantiated
+    template<typename Real, WaveType W, bool Filters, bool Flanger, bool Vibrato>
+    BfxrSynth::Kernel<Real> SelectKernel(bool overtones)
     {
-      auto r=random()*2-1;
-      r=pow(r,5);
-      slide =r;
+      if(overtones) return &BfxrSynth::synthBlock<Real, W, Filters, Flanger, Vibrato, true>;
+      else return &BfxrSynth::synthBlock<Real, W, Filters, Flanger, Vibrato, false>;
     }
-    if (!deltaSlide_locked)
-    {
-      auto r=random()*2-1;
-      r=pow(r,3);
-      deltaSlide =r;
+
+    template<typename Real, WaveType W, bool Filters, bool Flanger>
+    BfxrSynth::Kernel<Real> SelectKernel(bool vibrato, bool overtones)
+    {
+      if(vibrato) return SelectKernel<Real, W, Filters, Flanger, true>(overtones);
+      else return SelectKernel<Real, W, Filters, Flanger, false>(overtones);
     }
 
-    if (!minFrequency_locked)
-      minFrequency =0;
+    template<typename Real, WaveType W, bool Filters>
+    BfxrSynth::Kernel<Real> SelectKernel(bool flanger, bool vibrato, bool overtones)
+    {
+      if(flanger) return SelectKernel<Real, W, Filters, true>(vibrato, overtones);
+      else return SelectKernel<Real, W, Filters, false>(vibrato, overtones);
+    }
 
-    if (!startFrequency_locked)
-      startFrequency =  	(random() < 0.5) ? pow(random()*2-1, 2) : (pow(random() * 0.5, 3) + 0.5);
+    template<typename Real, WaveType W>
+    BfxrSynth::Kernel<Real> SelectKernel(bool filters, bool flanger, bool vibrato, bool overtones)
+    {
+      if(filters) return SelectKernel<Real, W, true>(flanger, vibrato, overtones);
+      else return SelectKernel<Real, W, false>(flanger, vibrato, overtones);
+    }
 
-    if ((!sustainTime_locked) && (!decayTime_locked))
+    template<typename Real>
+    BfxrSynth::Kernel<Real> SelectKernel(WaveType wave, bool filters, bool flanger, bool vibrato, bool overtones)
     {
-      if(attackTime + sustainTime + decayTime < 0.2)
+#define KERNEL(W) case WaveType::W: return SelectKernel<Real, WaveType::W>(filters, flanger, vibrato, overtones)
+      switch(wave)
       {
-        sustainTime = 0.2 + random() * 0.3;
-        decayTime = 0.2 + random() * 0.3;
+        KERNEL(Square);
+        KERNEL(Saw);
+        KERNEL(Sin);
+        KERNEL(Noise);
+        KERNEL(Triangle);
+        KERNEL(Pink);
+        KERNEL(Tan);
+        KERNEL(Whistle);
+        KERNEL(Breaker);
+        KERNEL(OneBitNoise);
+        KERNEL(Buzz);
+        case WaveType::COUNT:
+          break;
       }
+#undef KERNEL
+      assert(0 && "invalid wave type");
+      return SelectKernel<Real, WaveType::Square>(filters, flanger, vibrato, overtones);
     }
 
-    if (!slide_locked)
+    // Runs the kernel straight into the output when it has the same precision
+    template<typename Real>
+    void RunKernel(BfxrSynth* synth, BfxrSynth::Kernel<Real> kernel, Real* out, std::size_t n)
     {
-      if((startFrequency > 0.7 && slide > 0.2) || (startFrequency < 0.2 && slide < -0.05)) 
-      {
-        slide = -slide;
-      }
+      (synth->*kernel)(out, n);
     }
 
-    if (!lpFilterCutoffSweep_locked)
+    // ...and through a small buffer when it doesn't
+    template<typename Real, typename T>
+    void RunKernel(BfxrSynth* synth, BfxrSynth::Kernel<Real> kernel, T* out, std::size_t n)
     {
-      if(lpFilterCutoff < 0.1 && lpFilterCutoffSweep < -0.05) 
+      Real buffer[256];
+      for(std::size_t done = 0; done < n; )
       {
-        lpFilterCutoffSweep = -lpFilterCutoffSweep;
+        const auto chunk = std::min<std::size_t>(n - done, 256);
+        (synth->*kernel)(buffer, chunk);
+        for(std::size_t i=0; i<chunk; i+=1)
+        {
+          out[done + i] = static_cast<T>(buffer[i]);
+        }
+        done += chunk;
       }
     }
   }
-} // end of sfxr param
 
+  template<>
+  detail::OscillatorFunction<double> BfxrSynth::getOscillator<double>() const
+  {
+    return _oscillator;
+  }
 
-
-namespace bfxr
-{
-  constexpr double PI = 3.14;
-
-  double Abs(double d) {
-    if(d > 0) return d;
-    else return -d;
+  template<>
+  detail::OscillatorFunction<float> BfxrSynth::getOscillator<float>() const
+  {
+    return _oscillatorFloat;
   }
 
-  /**
-   * BfxrSynth
-   * 
-   * Copyright 2010 Thomas Vian
-   *
-   * Licensed under the Apache License, Version 2.0 (the "License");
-   * you may not use this file except in compliance with the License.
-   * You may obtain a copy of the License at
-   *
-   * 	http://www.apache.org/licenses/LICENSE-2.0
-   *
-   * Unless required by applicable law or agreed to in writing, software
-   * distributed under the License is distributed on an "AS IS" BASIS,
-   * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-   * See the License for the specific language governing permissions and
-   * limitations under the License.
-   * 
-   * @author Thomas Vian
-   */
-  struct BfxrSynth 
+  void BfxrSynth::clampTotalLength(double* attack, double* sustain, double* decay)
   {
-    BfxrSynth(const BfxrParams& p)
-      : _params(p)
+    const auto totalTime = *attack + *sustain + *decay;
+    if (totalTime < MIN_LENGTH ) 
     {
-      _finished = false;
+      const auto multiplier = MIN_LENGTH / totalTime;
+      *attack = *attack * multiplier;
+      *sustain = *sustain * multiplier;
+      *decay = *decay * multiplier;
+    }
+  }
+
+  void BfxrSynth::reset(bool totalReset)
+  {
+#if 1
+    const auto& p = _params;
+
+    // The constants below are tuned for the reference rate: lengths in samples
+    // are multiplied by rate, amounts added every sample by ratio, and factors
+    // applied every sample are raised to the ratio. Both are 1 at 44.1kHz
+    const double ratio = _rateRatio;
+    const double rate = 1.0 / ratio;
+
+    _period = 100.0 / (p.startFrequency * p.startFrequency + 0.001) * rate;
+    _maxPeriod = 100.0 / (p.minFrequency * p.minFrequency + 0.001) * rate;
+
+
+    _slide = std::pow(1.0 - p.slide * p.slide * p.slide * 0.01, ratio);
+    _deltaSlide = -p.deltaSlide * p.deltaSlide * p.deltaSlide * 0.000001 * ratio * ratio;
 
-      reset(true);
+    if (p.waveType == WaveType::Square)
+    {
+      _squareDuty = 0.5 - p.squareDuty * 0.5;
+      _dutySweep = -p.dutySweep * 0.00005 * ratio;
     }
 
-    double synthOneSample() {
-        if (_finished) 
-        {
-          return 0.0;
-        }
+    // removed a call to max(x) with a single arg
+    _changePeriod = ((((1-p.changeRepeat)+0.1)/1.1) * 20000 + 32) * rate;
+    _changePeriodTime = 0;
 
-        // Repeats every _repeatLimit times, partially resetting the sound parameters
-        if(_repeatLimit != 0)
-        {
-          if(++_repeatTime >= _repeatLimit)
-          {
-            _repeatTime = 0;
-            reset(false);
-          }
-        }
+    if (p.changeAmount > 0.0) 	_changeAmount = 1.0 - p.changeAmount * p.changeAmount * 0.9;
+    else 						_changeAmount = 1.0 + p.changeAmount * p.changeAmount * 10.0;
 
-        _changePeriodTime++;
-        if (_changePeriodTime>=_changePeriod)
-        {				
-          _changeTime=0;
-          _changeTime2=0;
-          _changePeriodTime=0;
-          if (_changeReached)
-          {
-            _period /= _changeAmount;
-            _changeReached=false;
-          }
-          if (_changeReached2)
-          {
-            _period /= _changeAmount2;
-            _changeReached2=false;
-          }
-        }
+    _changeTime = 0;
+    _changeReached=false;
 
-        // If _changeLimit is reached, shifts the pitch
-        if(!_changeReached)
-        {
-          if(++_changeTime >= _changeLimit)
-          {
-            _changeReached = true;
-            _period *= _changeAmount;
-          }
-        }
+    if(p.changeSpeed == 1.0) 	_changeLimit = 0;
+    else 						_changeLimit = ((1.0 - p.changeSpeed) * (1.0 - p.changeSpeed) * 20000 + 32) * rate;
 
-        // If _changeLimit is reached, shifts the pitch
-        if(!_changeReached2)
-        {
-          if(++_changeTime2 >= _changeLimit2)
-          {
-            _period *= _changeAmount2;
-            _changeReached2=true;
-          }
-        }
 
-        // Acccelerate and apply slide
-        _slide += _deltaSlide;
-        _period *= _slide;
+    if (p.changeAmount2 > 0.0) 	_changeAmount2 = 1.0 - p.changeAmount2 * p.changeAmount2 * 0.9;
+    else 						_changeAmount2 = 1.0 + p.changeAmount2 * p.changeAmount2 * 10.0;
 
-        // Checks for frequency getting too low, and stops the sound if a minFrequency was set
-        if(_period > _maxPeriod)
-        {
-          _period = _maxPeriod;
-          if(_minFreqency > 0.0) {
-            _muted = true;
-          }										
-        }
 
-        _periodTemp = _period;
+    _changeTime2 = 0;			
+    _changeReached2=false;
 
-        // Applies the vibrato effect
-        if(_vibratoAmplitude > 0.0)
-        {
-          _vibratoPhase += _vibratoSpeed;
-          _periodTemp = _period * (1.0 + std::sin(_vibratoPhase) * _vibratoAmplitude);
-        }
+    if(p.changeSpeed2 == 1.0) 	_changeLimit2 = 0;
+    else 						_changeLimit2 = ((1.0 - p.changeSpeed2) * (1.0 - p.changeSpeed2) * 20000 + 32) * rate;
 
-        _periodTemp = int(_periodTemp);
-        if(_periodTemp < 8) _periodTemp = 8;
+    _changeLimit*=(1-p.changeRepeat+0.1)/1.1;
+    _changeLimit2*=(1-p.changeRepeat+0.1)/1.1;
 
-        // Sweeps the square duty
-        if (_waveType == WaveType::Square)
-        {
-          _squareDuty += _dutySweep;
-          if(_squareDuty < 0.0) _squareDuty = 0.0;
-          else if (_squareDuty > 0.5) _squareDuty = 0.5;
-        }
+    if(totalReset)
+    {
+      _masterVolume = p.masterVolume * p.masterVolume;
+
+      _waveType = p.waveType;
+      _oscillator = detail::GetOscillator<double>(_settings.simdLevel, _waveType);
+      _oscillatorFloat = detail::GetOscillator<float>(_settings.simdLevel, _waveType);
+
+      // clamped into copies, _params stays as given so starting over from
+      // it gives the same envelope
+      double attackTime = p.attackTime;
+      double sustainTime = p.sustainTime;
+      double decayTime = p.decayTime;
+      if (sustainTime < 0.01) sustainTime = 0.01;
+
+      clampTotalLength(&attackTime, &sustainTime, &decayTime);
+
+      _sustainPunch = p.sustainPunch;
+
+      _phase = 0;
+
+      _minFreqency = p.minFrequency;
+      _muted=false;
+      _overtones = p.overtones*10;
+      _overtoneFalloff = p.overtoneFalloff;
+
+      _bitcrush_freq = (1 - pow(p.bitCrush,1.0/3.0)) * ratio;				
+      _bitcrush_freq_sweep = -p.bitCrushSweep* 0.000015 * ratio * ratio;
+      _bitcrush_phase=0;
+      _bitcrush_last=0;				
+
+      _compression_factor = 1/(1+4*p.compressionAmount);
+
+      _filters = p.lpFilterCutoff != 1.0 || p.hpFilterCutoff != 0.0;				
+
+      _lpFilterPos = 0.0;
+      _lpFilterDeltaPos = 0.0;
+      _lpFilterCutoff = p.lpFilterCutoff * p.lpFilterCutoff * p.lpFilterCutoff * 0.1;
+      _lpFilterDeltaCutoff = std::pow(1.0 + p.lpFilterCutoffSweep * 0.0001, ratio);
+      _lpFilterDamping = 5.0 / (1.0 + p.lpFilterResonance * p.lpFilterResonance * 20.0) * (0.01 + _lpFilterCutoff);
+      if (_lpFilterDamping > 0.8) _lpFilterDamping = 0.8;
+      _lpFilterDamping = std::pow(1.0 - _lpFilterDamping, ratio);
+      // the cutoff acts on the change of the change of the position
+      _lpFilterCutoff *= ratio * ratio;
+      _lpFilterOn = p.lpFilterCutoff != 1.0;
+
+      _hpFilterPos = 0.0;
+      _hpFilterCutoff = p.hpFilterCutoff * p.hpFilterCutoff * 0.1 * ratio;
+      _hpFilterDeltaCutoff = std::pow(1.0 + p.hpFilterCutoffSweep * 0.0003, ratio);
+
+      _vibratoPhase = 0.0;
+      _vibratoSpeed = p.vibratoSpeed * p.vibratoSpeed * 0.01 * ratio;
+      _vibratoAmplitude = p.vibratoDepth * 0.5;
+
+      _envelopeVolume = 0.0;
+      _envelopeStage = 0;
+      _envelopeTime = 0;
+      _envelopeLength0 = attackTime * attackTime * 100000.0 * rate;
+      _envelopeLength1 = sustainTime * sustainTime * 100000.0 * rate;
+      _envelopeLength2 = (decayTime * decayTime * 100000.0 + 10) * rate;
+      _envelopeLength = _envelopeLength0;
+      _envelopeFullLength = _envelopeLength0 + _envelopeLength1 + _envelopeLength2;
+
+      _envelopeOverLength0 = 1.0 / _envelopeLength0;
+      _envelopeOverLength1 = 1.0 / _envelopeLength1;
+      _envelopeOverLength2 = 1.0 / _envelopeLength2;
+
+      _flanger = p.flangerOffset != 0.0 || p.flangerSweep != 0.0;
+
+      // the offset is in sub-samples so its sweep per sample stays the same
+      _flangerOffset = p.flangerOffset * p.flangerOffset * 1020.0 * rate;
+      if(p.flangerOffset < 0.0) _flangerOffset = -_flangerOffset;
+      _flangerDeltaOffset = p.flangerSweep * p.flangerSweep * p.flangerSweep * 0.2;
+      _flangerPos = 0;
+
+      _flangerBuffer.clear();
+      if(_flanger)
+      {
+        _flangerBuffer.assign(flangerBufferSize(_settings.sampleRate), 0.0);
+      }
 
-        // Moves through the different stages of the volume envelope
-        if(++_envelopeTime > _envelopeLength)
-        {
-          _envelopeTime = 0;
+      _oneBitNoiseState = 1 << 14;
+      _oneBitNoise = 0;
+      _buzzState = 1 << 14;
+      _buzz = 0;
 
-          switch(++_envelopeStage)
-          {
-            case 1: _envelopeLength = _envelopeLength1; break;
-            case 2: _envelopeLength = _envelopeLength2; break;
-          }
-        }
+      _random.Fill(_noiseBuffer, 32);
+      _pinkNumber.Fill(_random, _pinkNoiseBuffer, 32);
 
-        // Sets the volume based on the position in the envelope
-        switch(_envelopeStage)
-        {
-          case 0: _envelopeVolume = _envelopeTime * _envelopeOverLength0; 									break;
-          case 1: _envelopeVolume = 1.0 + (1.0 - _envelopeTime * _envelopeOverLength1) * 2.0 * _sustainPunch; break;
-          case 2: _envelopeVolume = 1.0 - _envelopeTime * _envelopeOverLength2; 								break;
-          case 3: _envelopeVolume = 0.0; _finished = true; 													break;
-        }
+      // The Tan wave used to refill a lo-res noise buffer that was never
+      // read, only its first draws are kept so seeded sounds stay the same
+      for(int i = 0; i < 32 / LoResNoisePeriod; i++) _random();							
 
-        // Moves the flanger offset
-        if (_flanger)
-        {
-          _flangerOffset += _flangerDeltaOffset;
-          _flangerInt = int(_flangerOffset);
-          if(_flangerInt < 0) 	_flangerInt = -_flangerInt;
-          else if (_flangerInt > 1023) _flangerInt = 1023;
-        }
+      _repeatTime = 0;
 
-        // Moves the high-pass filter cutoff
-        if(_filters && _hpFilterDeltaCutoff != 0.0)
-        {
-          _hpFilterCutoff *= _hpFilterDeltaCutoff;
-          if(_hpFilterCutoff < 0.00001) 	_hpFilterCutoff = 0.00001;
-          else if(_hpFilterCutoff > 0.1) 		_hpFilterCutoff = 0.1;
-        }
+      if (p.repeatSpeed == 0.0) 	_repeatLimit = 0;
+      else 						_repeatLimit = int((1.0-p.repeatSpeed) * (1.0-p.repeatSpeed) * 20000 * rate) + int(32 * rate);
 
-        double _superSample = 0.0;
-        for(int j= 0; j < 8; j++)
-        {
-          // Cycles through the period
-          _phase++;
-          if(_phase >= _periodTemp)
-          {
-            _phase = _phase - _periodTemp; // todo: int double operation stored in int hrm...
+      const bool vibrato = _vibratoAmplitude > 0.0;
+      const bool overtones = _overtones > 0;
+      _kernel = detail::SelectKernel<double>(_waveType, _filters, _flanger, vibrato, overtones);
+      _kernelFloat = detail::SelectKernel<float>(_waveType, _filters, _flanger, vibrato, overtones);
+    }
+#endif
+  }
 
-            // Generates new random noise for this period
-            if(_waveType == WaveType::Noise) 
-            { 
-              for(unsigned int n= 0; n < 32; n++) _noiseBuffer[n] = random() * 2.0 - 1.0;
-            }
-            else if (_waveType == WaveType::Pink)
-            {
-              for(unsigned int n = 0; n < 32; n++) _pinkNoiseBuffer[n] = _pinkNumber.GetNextValue() * 2.0 - 1.0;
-            }
-            else if (_waveType == WaveType::Tan)
-            {
-              for(unsigned int n = 0; n < 32; n++) _loResNoiseBuffer[n] = ((n%LoResNoisePeriod)==0) ? random()*2.0-1.0 : _loResNoiseBuffer[n-1];							
-            }
-            else if (_waveType == WaveType::OneBitNoise)
-            {
-              // Based on SN76489 periodic "white" noise
-              // http://www.smspower.org/Development/SN76489?sid=ae16503f2fb18070f3f40f2af56807f1#NoiseChannel
-              // This one matches the behaviour of the SN76489 in the BBC Micro.
-              const int feedBit = (_oneBitNoiseState >> 1 & 1) ^ (_oneBitNoiseState & 1);
-              _oneBitNoiseState = _oneBitNoiseState >> 1 | (feedBit << 14);
-              _oneBitNoise = (~_oneBitNoiseState & 1) - 0.5;
-            }
-            else if (_waveType == WaveType::Buzz)
-            {
-              // Based on SN76489 periodic "white" noise
-              // http://www.smspower.org/Development/SN76489?sid=ae16503f2fb18070f3f40f2af56807f1#NoiseChannel
-              // This one doesn't match the behaviour of anything real, but it made a nice sound, so I kept it.
-              const int feedBit = (_buzzState >> 3 & 1) ^ (_buzzState & 1);
-              _buzzState = _buzzState >> 1 | (feedBit << 14);
-              _buzz = (~_buzzState & 1) - 0.5;
-            }
-          }
+  unsigned int BfxrSynth::GetNumberOfSamples()
+  {
+    // players are expected to pad short sounds with silence themselves
+    return static_cast<unsigned int>(_envelopeFullLength);
+  }
 
-          double _sample=0;
-          double overtonestrength=1;
-          for (int k=0;k<=_overtones;k++)
-          {
-            double tempphase= fmod((_phase*(k+1)),_periodTemp);
-            // Gets the sample from the oscillator
-            switch(_waveType)
-            {
-              case WaveType::Square:
-                {
-                  _sample += overtonestrength*(((tempphase / _periodTemp) < _squareDuty) ? 0.5 : -0.5);
-                  break;
-                }
-              case WaveType::Saw:
-                {
-                  _sample += overtonestrength*(1.0 - (tempphase / _periodTemp) * 2.0);
-                  break;
-                }
-              case WaveType::Sin:
-                {								
-                  _pos = tempphase / _periodTemp;
-                  _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
-                  double _tempsample= _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
-                  _sample += overtonestrength*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);								
-                  break;
-                }
-              case WaveType::Noise:
-                {
-                  _sample += overtonestrength*(_noiseBuffer[static_cast<unsigned int>(tempphase * 32 / int(_periodTemp))%32]);
-                  break;
-                }
-              case WaveType::Triangle:
-                {						
-                  _sample += overtonestrength*(Abs(1-(tempphase / _periodTemp)*2)-1);
-                  break;
-                }
-              case WaveType::Pink:
-                {						
-                  _sample += overtonestrength*(_pinkNoiseBuffer[static_cast<unsigned int>(tempphase * 32 / int(_periodTemp))%32]);
-                  break;
-                }
-              case WaveType::Tan:
-                {
-                  //detuned
-                  _sample += tan(PI*tempphase/_periodTemp)*overtonestrength;
-                  break;
-                }
-              case WaveType::Whistle:
-                {				
-                  // Sin wave code
-                  _pos = tempphase / _periodTemp;
-                  _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
-                  double _tempsample = _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
-                  double value= 0.75*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);
-                  //then whistle (essentially an overtone with frequencyx20 and amplitude0.25
-
-                  _pos = fmod((tempphase*20) , _periodTemp) / _periodTemp;
-                  _pos = _pos > 0.5 ? (_pos - 1.0) * 6.28318531 : _pos * 6.28318531;
-                  _tempsample = _pos < 0 ? 1.27323954 * _pos + .405284735 * _pos * _pos : 1.27323954 * _pos - 0.405284735 * _pos * _pos;
-                  value += 0.25*(_tempsample < 0 ? .225 * (_tempsample *-_tempsample - _tempsample) + _tempsample : .225 * (_tempsample * _tempsample - _tempsample) + _tempsample);
-
-                  _sample += overtonestrength*value;//main wave
-
-                  break;
-                }
-              case WaveType::Breaker:
-                {	
-                  double amp= tempphase/_periodTemp;								
-                  _sample += overtonestrength*(Abs(1-amp*amp*2)-1);
-                  break;
-                }
-              case WaveType::OneBitNoise: // 1-bit periodic "white" noise
-                {
-                  _sample += overtonestrength*_oneBitNoise;
-                  break;
-                }
-              case WaveType::Buzz: // 1-bit periodic "buzz" noise
-                {
-                  _sample += overtonestrength*_buzz;
-                  break;
-                }
-              case WaveType::COUNT:
-                assert(0 && "invalid case");
-                break;
-            }
-            overtonestrength*=(1-_overtoneFalloff);
+  std::size_t BfxrSynth::samplesLeft(std::size_t n)
+  {
+    if(_finished) return 0;
+    const std::size_t total = GetNumberOfSamples();
+    const std::size_t left = _sampleIndex < total ? total - _sampleIndex : 0;
+    return std::min(n, left);
+  }
 
-          }					
+  template<typename T>
+  std::size_t BfxrSynth::renderInto(T* out, std::size_t n)
+  {
+    const auto count = samplesLeft(n);
+    if(_settings.precision == Precision::Float)
+    {
+      detail::RunKernel(this, _kernelFloat, out, count);
+    }
+    else
+    {
+      detail::RunKernel(this, _kernel, out, count);
+    }
+    _sampleIndex += count;
+    return count;
+  }
 
-          // Applies the low and high pass filters
-          if (_filters)
-          {
-            _lpFilterOldPos = _lpFilterPos;
-            _lpFilterCutoff *= _lpFilterDeltaCutoff;
-            if(_lpFilterCutoff < 0.0) _lpFilterCutoff = 0.0;
-            else if(_lpFilterCutoff > 0.1) _lpFilterCutoff = 0.1;
+  std::size_t BfxrSynth::renderBlock(float* out, std::size_t n)
+  {
+    return renderInto(out, n);
+  }
 
-            if(_lpFilterOn)
-            {
-              _lpFilterDeltaPos += (_sample - _lpFilterPos) * _lpFilterCutoff;
-              _lpFilterDeltaPos *= _lpFilterDamping;
-            }
-            else
-            {
-              _lpFilterPos = _sample;
-              _lpFilterDeltaPos = 0.0;
-            }
+  std::size_t BfxrSynth::renderBlock(double* out, std::size_t n)
+  {
+    return renderInto(out, n);
+  }
 
-            _lpFilterPos += _lpFilterDeltaPos;
+  std::size_t BfxrSynth::position() const
+  {
+    return _sampleIndex;
+  }
 
-            _hpFilterPos += _lpFilterPos - _lpFilterOldPos;
-            _hpFilterPos *= 1.0 - _hpFilterCutoff;
-            _sample = _hpFilterPos;
-          }
+  void BfxrSynth::seek(std::size_t sample)
+  {
+    if(sample < _sampleIndex)
+    {
+      // the state can't be run backwards
+      *this = BfxrSynth(_params, _settings);
+    }
 
-          // Applies the flanger effect
-          if (_flanger)
-          {
-            _flangerBuffer[_flangerPos&1023] = _sample;
-            _sample += _flangerBuffer[(_flangerPos - _flangerInt + 1024) & 1023];
-            _flangerPos = (_flangerPos + 1) & 1023;
-          }
+    double skipped[256];
+    while(_sampleIndex < sample)
+    {
+      const auto count = std::min(sample - _sampleIndex, sizeof(skipped) / sizeof(skipped[0]));
+      if(renderBlock(skipped, count) == 0) break;
+    }
+  }
 
-          _superSample += _sample;
-        }
+  constexpr std::size_t BfxrSynth::GenerateBlockSize;
 
-        // Clipping if too loud
-        if(_superSample > 8.0) 	_superSample = 8.0;
-        else if(_superSample < -8.0) 	_superSample = -8.0;					 				 				
+  template<typename T>
+  bool BfxrSynth::generateInto(std::vector<T>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled)
+  {
+    // size the output once and let the synth write straight into it, in one
+    // go unless it can be cancelled
+    const auto offset = data->size();
+    data->resize(offset + GetNumberOfSamples());
+    const auto total = data->size() - offset;
+    std::size_t written = 0;
+    while(written < total)
+    {
+      if(cancelled && cancelled())
+      {
+        data->resize(offset);
+        return false;
+      }
 
-        // Averages out the super samples and applies volumes
-        _superSample = _masterVolume * _envelopeVolume * _superSample * 0.125;				
+      const auto count = cancelled ? std::min(GenerateBlockSize, total - written) : total - written;
+      T* out = data->data() + offset + written;
+      const auto rendered = checkpoints ? checkpoints->renderBlock(this, out, count) : renderBlock(out, count);
+      written += rendered;
+      if(rendered < count) break;
+    }
 
+    data->resize(offset + written);
+    TrimSilence(data, offset);
+    return true;
+  }
 
-        //BIT CRUSH				
-        _bitcrush_phase+=_bitcrush_freq;
-        if (_bitcrush_phase>1)
-        {
-          _bitcrush_phase=0;
-          _bitcrush_last=_superSample;	 
-        }
-        _bitcrush_freq = std::max(std::min(_bitcrush_freq+_bitcrush_freq_sweep,1.0),0.0);
+  void BfxrSynth::GenerateSound(std::vector<double>* data, SynthCheckpoints* checkpoints)
+  {
+    generateInto(data, checkpoints, nullptr);
+  }
 
-        _superSample=_bitcrush_last; 				
+  void BfxrSynth::GenerateSound(std::vector<float>* data, SynthCheckpoints* checkpoints)
+  {
+    generateInto(data, checkpoints, nullptr);
+  }
 
+  bool BfxrSynth::GenerateSound(std::vector<double>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled)
+  {
+    return generateInto(data, checkpoints, cancelled);
+  }
 
+  bool BfxrSynth::GenerateSound(std::vector<float>* data, SynthCheckpoints* checkpoints, const std::function<bool()>& cancelled)
+  {
+    return generateInto(data, checkpoints, cancelled);
+  }
 
-        //compressor
+  SynthCheckpoints::SynthCheckpoints(std::size_t interval)
+    : _interval(std::max<std::size_t>(interval, 1))
+  {
+  }
 
-        if (_superSample>0)
-        {
-          _superSample = pow(_superSample,_compression_factor);
-        }
-        else
-        {
-          _superSample = -pow(-_superSample,_compression_factor);
-        }
+  template<typename T>
+  std::size_t SynthCheckpoints::renderInto(BfxrSynth* synth, T* out, std::size_t n)
+  {
+    std::size_t written = 0;
+    while(written < n)
+    {
+      const auto position = synth->position();
+      const auto next = _checkpoints.size() * _interval;
+      if(position == next)
+      {
+        _checkpoints.push_back(*synth);
+        continue;
+      }
 
-        if (_muted)
-        {
-          _superSample = 0;
-        }
+      // only stops on the checkpoints that are still missing
+      const auto count = position < next ? std::min(n - written, next - position) : n - written;
+      const auto rendered = synth->renderBlock(out + written, count);
+      written += rendered;
+      if(rendered < count) break;
+    }
+    return written;
+  }
+
+  std::size_t SynthCheckpoints::renderBlock(BfxrSynth* synth, float* out, std::size_t n)
+  {
+    return renderInto(synth, out, n);
+  }
+
+  std::size_t SynthCheckpoints::renderBlock(BfxrSynth* synth, double* out, std::size_t n)
+  {
+    return renderInto(synth, out, n);
+  }
+
+  void SynthCheckpoints::seek(BfxrSynth* synth, std::size_t sample) const
+  {
+    if(!_checkpoints.empty())
+    {
+      const auto index = std::min(sample / _interval, _checkpoints.size() - 1);
+      // keeps going from where the synth is when that is closer
+      if(synth->position() > sample || synth->position() < index * _interval)
+      {
+        *synth = _checkpoints[index];
+      }
+    }
+    synth->seek(sample);
+  }
+
+  void SynthCheckpoints::clear()
+  {
+    _checkpoints.clear();
+  }
+
+  std::size_t SynthCheckpoints::interval() const
+  {
+    return _interval;
+  }
+
+  std::size_t SynthCheckpoints::size() const
+  {
+    return _checkpoints.size();
+  }
+
+  constexpr std::size_t Mixer::MixBlockSize;
+
+  Mixer::Voice::Voice(const BfxrParams& params, const RenderSettings& settings)
+    : synth(params, settings)
+    , volume(0.0f)
+    , priority(0)
+    , started(0)
+    , playing(false)
+  {
+    // the audio thread only ever reuses this memory
+    synth._flangerBuffer.reserve(BfxrSynth::flangerBufferSize(settings.sampleRate));
+  }
+
+  Mixer::Mixer(int voices, const RenderSettings& settings, std::size_t queueSize)
+    : _settings(settings)
+    , _block(MixBlockSize)
+    , _mix(detail::GetMixFunction(settings.simdLevel))
+    , _enqueuePosition(0)
+    , _dequeuePosition(0)
+    , _started(0)
+    , _activeVoices(0)
+  {
+    _voices.reserve(voices);
+    for(int i = 0; i < voices; i += 1)
+    {
+      _voices.emplace_back(BfxrParams(), _settings);
+    }
 
-        return _superSample;
+    // the queue indexes with a mask so its size is a power of two
+    std::size_t size = 2;
+    while(size < queueSize) size *= 2;
+    _slots.reset(new Slot[size]);
+    _slotMask = size - 1;
+    for(std::size_t i = 0; i < size; i += 1)
+    {
+      _slots[i].sequence.store(i, std::memory_order_relaxed);
     }
+  }
+
+  bool Mixer::play(const BfxrParams& params, float volume, int priority)
+  {
+    Command command;
+    command.type = Command::Type::Play;
+    command.params = params;
+    command.volume = volume;
+    command.priority = priority;
+    return push(command);
+  }
+
+  bool Mixer::stopAll()
+  {
+    Command command;
+    command.type = Command::Type::StopAll;
+    command.volume = 0.0f;
+    command.priority = 0;
+    return push(command);
+  }
 
-    void clampTotalLength()
+  bool Mixer::push(const Command& command)
+  {
+    std::size_t position = _enqueuePosition.load(std::memory_order_relaxed);
+    for(;;)
     {
-      auto& p = _params;
-      const auto totalTime = p.attackTime + p.sustainTime + p.decayTime;
-      if (totalTime < MIN_LENGTH ) 
+      Slot& slot = _slots[position & _slotMask];
+      const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+      if(difference == 0)
+      {
+        // the slot is free, claim it unless another thread got there first
+        if(_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+        {
+          slot.command = command;
+          slot.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if(difference < 0)
+      {
+        // the mixer hasn't taken the command from a lap ago yet
+        return false;
+      }
+      else
       {
-        const auto multiplier = MIN_LENGTH / totalTime;
-        p.attackTime =p.attackTime * multiplier;
-        p.sustainTime =p.sustainTime * multiplier;
-        p.decayTime =p.decayTime * multiplier;
+        position = _enqueuePosition.load(std::memory_order_relaxed);
       }
     }
+  }
 
-    /**
-     * Resets the runing variables from the params
-     * Used once at the start (total reset) and for the repeat effect (partial reset)
-     * @param	totalReset	If the reset is total
-     */
-    void reset(bool totalReset)
+  bool Mixer::pop(Command* command)
+  {
+    Slot& slot = _slots[_dequeuePosition & _slotMask];
+    if(slot.sequence.load(std::memory_order_acquire) != _dequeuePosition + 1)
     {
-#if 1
-      auto& p = _params;
+      return false;
+    }
+    *command = slot.command;
+    slot.sequence.store(_dequeuePosition + _slotMask + 1, std::memory_order_release);
+    _dequeuePosition += 1;
+    return true;
+  }
 
-      _period = 100.0 / (p.startFrequency * p.startFrequency + 0.001);
-      _maxPeriod = 100.0 / (p.minFrequency * p.minFrequency + 0.001);
+  void Mixer::start(const Command& command)
+  {
+    // a free voice, or else the lowest priority and then the oldest sound
+    Voice* target = nullptr;
+    for(auto& voice : _voices)
+    {
+      if(!voice.playing)
+      {
+        target = &voice;
+        break;
+      }
+      if(target == nullptr || voice.priority < target->priority
+          || (voice.priority == target->priority && voice.started < target->started))
+      {
+        target = &voice;
+      }
+    }
 
+    if(target == nullptr || (target->playing && target->priority > command.priority))
+    {
+      return;
+    }
 
-      _slide = 1.0 - p.slide * p.slide * p.slide * 0.01;
-      _deltaSlide = -p.deltaSlide * p.deltaSlide * p.deltaSlide * 0.000001;
+    target->synth.start(command.params, _settings.seed + _started);
+    target->volume = command.volume;
+    target->priority = command.priority;
+    target->started = _started;
+    target->playing = true;
+    _started += 1;
+  }
 
-      if (p.waveType == WaveType::Square)
+  void Mixer::mix(float* out, std::size_t n)
+  {
+    Command command;
+    while(pop(&command))
+    {
+      if(command.type == Command::Type::Play)
       {
-        _squareDuty = 0.5 - p.squareDuty * 0.5;
-        _dutySweep = -p.dutySweep * 0.00005;
+        start(command);
       }
+      else
+      {
+        for(auto& voice : _voices) voice.playing = false;
+      }
+    }
 
-      // removed a call to max(x) with a single arg
-      _changePeriod = (((1-p.changeRepeat)+0.1)/1.1) * 20000 + 32;
-      _changePeriodTime = 0;
+    std::fill(out, out + n, 0.0f);
 
-      if (p.changeAmount > 0.0) 	_changeAmount = 1.0 - p.changeAmount * p.changeAmount * 0.9;
-      else 						_changeAmount = 1.0 + p.changeAmount * p.changeAmount * 10.0;
+    int active = 0;
+    for(auto& voice : _voices)
+    {
+      for(std::size_t offset = 0; voice.playing && offset < n; offset += MixBlockSize)
+      {
+        const std::size_t count = std::min(MixBlockSize, n - offset);
+        const std::size_t rendered = voice.synth.renderBlock(_block.data(), count);
+        _mix(out + offset, _block.data(), voice.volume, rendered);
+        voice.playing = rendered == count;
+      }
+      if(voice.playing) active += 1;
+    }
+    _activeVoices.store(active, std::memory_order_relaxed);
+  }
 
-      _changeTime = 0;
-      _changeReached=false;
+  int Mixer::activeVoices() const
+  {
+    return _activeVoices.load(std::memory_order_relaxed);
+  }
 
-      if(p.changeSpeed == 1.0) 	_changeLimit = 0;
-      else 						_changeLimit = (1.0 - p.changeSpeed) * (1.0 - p.changeSpeed) * 20000 + 32;
+  RenderCache::RenderCache(std::size_t budgetBytes)
+    : _budget(budgetBytes)
+    , _used(0)
+    , _hits(0)
+    , _misses(0)
+  {
+  }
 
+  bool RenderCache::Key::operator==(const Key& other) const
+  {
+    return values == other.values && seed == other.seed && precision == other.precision
+      && simdLevel == other.simdLevel && oversampling == other.oversampling
+      && sampleRate == other.sampleRate && fastMath == other.fastMath;
+  }
 
-      if (p.changeAmount2 > 0.0) 	_changeAmount2 = 1.0 - p.changeAmount2 * p.changeAmount2 * 0.9;
-      else 						_changeAmount2 = 1.0 + p.changeAmount2 * p.changeAmount2 * 10.0;
+  std::size_t RenderCache::KeyHash::operator()(const Key& key) const
+  {
+    // mixes every field with the splitmix64 finalizer
+    std::uint64_t hash = 0;
+    const auto add = [&hash](std::uint64_t value)
+    {
+      hash += value + 0x9e3779b97f4a7c15;
+      hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+      hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+      hash = hash ^ (hash >> 31);
+    };
+    for(const auto value : key.values) add(static_cast<std::uint64_t>(value));
+    add(key.seed);
+    add(static_cast<std::uint64_t>(key.precision) | static_cast<std::uint64_t>(key.simdLevel) << 8
+        | static_cast<std::uint64_t>(key.fastMath) << 16);
+    add(static_cast<std::uint64_t>(key.oversampling) << 32 | static_cast<std::uint32_t>(key.sampleRate));
+    return static_cast<std::size_t>(hash);
+  }
 
+  RenderCache::Key RenderCache::makeKey(const BfxrParams& params, const RenderSettings& settings)
+  {
+    // 2^20 steps per unit, about a millionth
+    constexpr double Steps = 1024.0 * 1024.0;
 
-      _changeTime2 = 0;			
-      _changeReached2=false;
+    BfxrParams canonical = params;
+    if(params.waveType != WaveType::Square)
+    {
+      canonical.squareDuty = 0.0;
+      canonical.dutySweep = 0.0;
+    }
 
-      if(p.changeSpeed2 == 1.0) 	_changeLimit2 = 0;
-      else 						_changeLimit2 = (1.0 - p.changeSpeed2) * (1.0 - p.changeSpeed2) * 20000 + 32;
+    Key key;
+    std::size_t index = 0;
+    key.values[index++] = static_cast<std::int64_t>(canonical.waveType);
+#define ONVAR(param) do { key.values[index++] = std::llround(canonical.param * Steps); } while(false)
+    ALLVALUES
+#undef ONVAR
+    assert(index == key.values.size());
+
+    const bool noise = params.waveType == WaveType::Noise || params.waveType == WaveType::Pink;
+    key.seed = noise ? settings.seed : 0;
+    key.precision = settings.precision;
+    key.simdLevel = settings.simdLevel;
+    key.oversampling = settings.oversampling;
+    key.sampleRate = settings.sampleRate;
+    key.fastMath = settings.fastMath;
+    return key;
+  }
 
-      _changeLimit*=(1-p.changeRepeat+0.1)/1.1;
-      _changeLimit2*=(1-p.changeRepeat+0.1)/1.1;
+  std::shared_ptr<const std::vector<double>> RenderCache::lookup(const Key& key)
+  {
+    const auto found = _index.find(key);
+    if(found == _index.end())
+    {
+      _misses += 1;
+      return nullptr;
+    }
 
-      if(totalReset)
-      {
-        _masterVolume = p.masterVolume * p.masterVolume;
+    _hits += 1;
+    _entries.splice(_entries.begin(), _entries, found->second);
+    return found->second->sound;
+  }
 
-        _waveType = p.waveType;
+  std::shared_ptr<const std::vector<double>> RenderCache::get(const BfxrParams& params, const RenderSettings& settings)
+  {
+    const auto key = makeKey(params, settings);
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if(auto sound = lookup(key)) return sound;
+    }
 
-        if (p.sustainTime < 0.01) p.sustainTime = 0.01;
+    // renders without holding the lock so other threads keep hitting
+    std::vector<double> sound;
+    GenerateSound(params, &sound, settings);
+    return insert(params, settings, std::move(sound));
+  }
 
-        clampTotalLength();
+  std::shared_ptr<const std::vector<double>> RenderCache::find(const BfxrParams& params, const RenderSettings& settings)
+  {
+    const auto key = makeKey(params, settings);
+    std::lock_guard<std::mutex> lock(_mutex);
+    return lookup(key);
+  }
 
-        _sustainPunch = p.sustainPunch;
+  std::shared_ptr<const std::vector<double>> RenderCache::insert(const BfxrParams& params, const RenderSettings& settings, std::vector<double> sound)
+  {
+    sound.shrink_to_fit();
+    const auto bytes = sizeof(Entry) + sound.size() * sizeof(double);
+    std::shared_ptr<const std::vector<double>> shared = std::make_shared<const std::vector<double>>(std::move(sound));
+    const auto key = makeKey(params, settings);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto found = _index.find(key);
+    if(found != _index.end())
+    {
+      // another thread got there first, keep the sound that may already be in use
+      _entries.splice(_entries.begin(), _entries, found->second);
+      return found->second->sound;
+    }
 
-        _phase = 0;
+    if(bytes > _budget) return shared;
 
-        _minFreqency = p.minFrequency;
-        _muted=false;
-        _overtones = p.overtones*10;
-        _overtoneFalloff = p.overtoneFalloff;
+    _entries.push_front(Entry{key, shared, bytes});
+    _index.emplace(key, _entries.begin());
+    _used += bytes;
+    evict();
+    return shared;
+  }
 
-        _bitcrush_freq = 1 - pow(p.bitCrush,1.0/3.0);				
-        _bitcrush_freq_sweep = -p.bitCrushSweep* 0.000015;
-        _bitcrush_phase=0;
-        _bitcrush_last=0;				
+  void RenderCache::evict()
+  {
+    while(_used > _budget && !_entries.empty())
+    {
+      const auto& last = _entries.back();
+      _used -= last.bytes;
+      _index.erase(last.key);
+      _entries.pop_back();
+    }
+  }
 
-        _compression_factor = 1/(1+4*p.compressionAmount);
+  void RenderCache::setBudget(std::size_t budgetBytes)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _budget = budgetBytes;
+    evict();
+  }
 
-        _filters = p.lpFilterCutoff != 1.0 || p.hpFilterCutoff != 0.0;				
+  void RenderCache::clear()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _index.clear();
+    _entries.clear();
+    _used = 0;
+  }
 
-        _lpFilterPos = 0.0;
-        _lpFilterDeltaPos = 0.0;
-        _lpFilterCutoff = p.lpFilterCutoff * p.lpFilterCutoff * p.lpFilterCutoff * 0.1;
-        _lpFilterDeltaCutoff = 1.0 + p.lpFilterCutoffSweep * 0.0001;
-        _lpFilterDamping = 5.0 / (1.0 + p.lpFilterResonance * p.lpFilterResonance * 20.0) * (0.01 + _lpFilterCutoff);
-        if (_lpFilterDamping > 0.8) _lpFilterDamping = 0.8;
-        _lpFilterDamping = 1.0 - _lpFilterDamping;
-        _lpFilterOn = p.lpFilterCutoff != 1.0;
+  std::size_t RenderCache::budget() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _budget;
+  }
 
-        _hpFilterPos = 0.0;
-        _hpFilterCutoff = p.hpFilterCutoff * p.hpFilterCutoff * 0.1;
-        _hpFilterDeltaCutoff = 1.0 + p.hpFilterCutoffSweep * 0.0003;
+  std::size_t RenderCache::memoryUsed() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _used;
+  }
 
-        _vibratoPhase = 0.0;
-        _vibratoSpeed = p.vibratoSpeed * p.vibratoSpeed * 0.01;
-        _vibratoAmplitude = p.vibratoDepth * 0.5;
+  std::size_t RenderCache::size() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+  }
 
-        _envelopeVolume = 0.0;
-        _envelopeStage = 0;
-        _envelopeTime = 0;
-        _envelopeLength0 = p.attackTime * p.attackTime * 100000.0;
-        _envelopeLength1 = p.sustainTime * p.sustainTime * 100000.0;
-        _envelopeLength2 = p.decayTime * p.decayTime * 100000.0 + 10;
-        _envelopeLength = _envelopeLength0;
-        _envelopeFullLength = _envelopeLength0 + _envelopeLength1 + _envelopeLength2;
+  std::uint64_t RenderCache::hits() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+  }
 
-        _envelopeOverLength0 = 1.0 / _envelopeLength0;
-        _envelopeOverLength1 = 1.0 / _envelopeLength1;
-        _envelopeOverLength2 = 1.0 / _envelopeLength2;
+  std::uint64_t RenderCache::misses() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses;
+  }
 
-        _flanger = p.flangerOffset != 0.0 || p.flangerSweep != 0.0;
+  void RenderCache::resetCounters()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _hits = 0;
+    _misses = 0;
+  }
 
-        _flangerOffset = p.flangerOffset * p.flangerOffset * 1020.0;
-        if(p.flangerOffset < 0.0) _flangerOffset = -_flangerOffset;
-        _flangerDeltaOffset = p.flangerSweep * p.flangerSweep * p.flangerSweep * 0.2;
-        _flangerPos = 0;
+  void GenerateSound(const BfxrParams& params, std::vector<double>* data, const RenderSettings& settings)
+  {
+    BfxrSynth synth{params, settings};
+    synth.GenerateSound(data);
+  }
 
-        _flangerBuffer.reserve(1024);
-        _noiseBuffer.reserve(32);
-        _pinkNoiseBuffer.reserve(32);
-        _loResNoiseBuffer.reserve(32);
+  void GenerateSound(const BfxrParams& params, std::vector<float>* data, const RenderSettings& settings)
+  {
+    BfxrSynth synth{params, settings};
+    synth.GenerateSound(data);
+  }
 
-        _oneBitNoiseState = 1 << 14;
-        _oneBitNoise = 0;
-        _buzzState = 1 << 14;
-        _buzz = 0;
+  namespace detail
+  {
+    template<typename T>
+    void TrimSilence(std::vector<T>* data, std::size_t offset)
+    {
+      auto size = data->size();
+      while(size > offset && (*data)[size - 1] == 0) size -= 1;
+      data->resize(size);
+    }
+  }
 
-        for(unsigned int i= 0; i < 1024; i++) _flangerBuffer[i] = 0.0;
-        for(unsigned int i = 0; i < 32; i++) _noiseBuffer[i] = random() * 2.0 - 1.0;
-        for(unsigned int i = 0; i < 32; i++) _pinkNoiseBuffer[i] = _pinkNumber.GetNextValue() * 2.0 - 1.0;
-        for(unsigned int i = 0; i < 32; i++) _loResNoiseBuffer[i] = ((i%LoResNoisePeriod)==0) ? random()*2.0-1.0 : _loResNoiseBuffer[i-1];							
+  void TrimSilence(std::vector<double>* data, std::size_t offset)
+  {
+    detail::TrimSilence(data, offset);
+  }
 
-        _repeatTime = 0;
+  void TrimSilence(std::vector<float>* data, std::size_t offset)
+  {
+    detail::TrimSilence(data, offset);
+  }
 
-        if (p.repeatSpeed == 0.0) 	_repeatLimit = 0;
-        else 						_repeatLimit = int((1.0-p.repeatSpeed) * (1.0-p.repeatSpeed) * 20000) + 32;
-      }
-#endif
+#ifdef BFXR_SIMD_X86
+  namespace detail
+  {
+    template<typename Ops, typename T>
+    BFXR_SIMD_INLINE typename Ops::Vector LoadLanes(BfxrSynth* const* synths, T BfxrSynth::* field)
+    {
+      double values[Ops::Width];
+      for(int l = 0; l < Ops::Width; l += 1) values[l] = static_cast<double>(synths[l]->*field);
+      return Ops::Load(values);
     }
 
-    unsigned int GetNumberOfSamples()
+    template<typename Ops>
+    BFXR_SIMD_INLINE typename Ops::Vector LoadMask(BfxrSynth* const* synths, bool BfxrSynth::* field)
     {
-      // If the sound is smaller than the buffer length, add silence to allow it to play
-      return std::max<unsigned int>(1536, _envelopeFullLength);
+      double values[Ops::Width];
+      for(int l = 0; l < Ops::Width; l += 1) values[l] = synths[l]->*field ? 1.0 : 0.0;
+      return Ops::NotEqual(Ops::Load(values), Ops::Set(0.0));
     }
 
-    void GenerateSound(std::vector<double>* data)
+    // Renders Ops::Width sounds of the wave W at once, one sound per lane, in
+    // double precision. The synths must have just been constructed and can't
+    // use the flanger or band-limiting. The state of synthBlock() is kept as
+    // one vector per variable, the branches become selects, and the little
+    // that can't be vectorized (the vibrato sine and the compressor) is done
+    // lane by lane. Every lane does the same operations in the same order as
+    // synthBlock() so the output is identical to rendering the sounds one by one
+    template<typename Ops, WaveType W>
+    BFXR_SIMD_INLINE void RenderLanes(BfxrSynth* const* synths, double* const* outs, const std::size_t* lengths)
     {
-      const auto samples = GetNumberOfSamples();
-      for(unsigned int i=0; i< samples; i+=1) {
-        data->push_back(synthOneSample());
+      typedef typename Ops::Vector V;
+      const int Width = Ops::Width;
+      const V zero = Ops::Set(0.0);
+      const V one = Ops::Set(1.0);
+      const V all = Ops::Equal(zero, zero);
+
+      const BfxrSynth& first = *synths[0];
+      const double ratio = first._rateRatio;
+      const V lpFilterMaxCutoff = Ops::Set(0.1 * ratio * ratio);
+      const V hpFilterMinCutoff = Ops::Set(0.00001 * ratio);
+      const V hpFilterMaxCutoff = Ops::Set(0.1 * ratio);
+      const V bitcrushMaxFreq = Ops::Set(ratio);
+      const bool fastMath = first._settings.fastMath;
+
+      // Constant while rendering
+      const V maxPeriod = LoadLanes<Ops>(synths, &BfxrSynth::_maxPeriod);
+      const V deltaSlide = LoadLanes<Ops>(synths, &BfxrSynth::_deltaSlide);
+      const V minFrequency = LoadLanes<Ops>(synths, &BfxrSynth::_minFreqency);
+      const V changePeriod = LoadLanes<Ops>(synths, &BfxrSynth::_changePeriod);
+      const V changeAmount = LoadLanes<Ops>(synths, &BfxrSynth::_changeAmount);
+      const V changeLimit = LoadLanes<Ops>(synths, &BfxrSynth::_changeLimit);
+      const V changeAmount2 = LoadLanes<Ops>(synths, &BfxrSynth::_changeAmount2);
+      const V changeLimit2 = LoadLanes<Ops>(synths, &BfxrSynth::_changeLimit2);
+      const V repeatLimit = LoadLanes<Ops>(synths, &BfxrSynth::_repeatLimit);
+      const V vibratoSpeed = LoadLanes<Ops>(synths, &BfxrSynth::_vibratoSpeed);
+      const V vibratoAmplitude = LoadLanes<Ops>(synths, &BfxrSynth::_vibratoAmplitude);
+      const V dutySweep = W == WaveType::Square ? LoadLanes<Ops>(synths, &BfxrSynth::_dutySweep) : zero;
+      const V envelopeLength1 = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeLength1);
+      const V envelopeLength2 = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeLength2);
+      const V envelopeOverLength0 = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeOverLength0);
+      const V envelopeOverLength1 = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeOverLength1);
+      const V envelopeOverLength2 = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeOverLength2);
+      const V sustainPunch = LoadLanes<Ops>(synths, &BfxrSynth::_sustainPunch);
+      const V lpFilterDeltaCutoff = LoadLanes<Ops>(synths, &BfxrSynth::_lpFilterDeltaCutoff);
+      const V lpFilterDamping = LoadLanes<Ops>(synths, &BfxrSynth::_lpFilterDamping);
+      const V hpFilterDeltaCutoff = LoadLanes<Ops>(synths, &BfxrSynth::_hpFilterDeltaCutoff);
+      const V overtones = LoadLanes<Ops>(synths, &BfxrSynth::_overtones);
+      const V overtoneFalloff = LoadLanes<Ops>(synths, &BfxrSynth::_overtoneFalloff);
+      const V masterVolume = LoadLanes<Ops>(synths, &BfxrSynth::_masterVolume);
+      const V bitcrushFreqSweep = LoadLanes<Ops>(synths, &BfxrSynth::_bitcrush_freq_sweep);
+      const V filters = LoadMask<Ops>(synths, &BfxrSynth::_filters);
+      const V lpFilterOn = LoadMask<Ops>(synths, &BfxrSynth::_lpFilterOn);
+      const V hpFilterSweeps = Ops::And(filters, Ops::NotEqual(hpFilterDeltaCutoff, zero));
+      const V repeats = Ops::NotEqual(repeatLimit, zero);
+      const V vibrato = Ops::Greater(vibratoAmplitude, zero);
+      const bool anyVibrato = Ops::Any(vibrato);
+      const bool anyFilters = Ops::Any(filters);
+
+      int maxOvertones = 0;
+      bool anyCompression = false;
+      double compression[Width];
+      std::size_t length = 0;
+      for(int l = 0; l < Width; l += 1)
+      {
+        maxOvertones = std::max(maxOvertones, synths[l]->_overtones);
+        compression[l] = synths[l]->_compression_factor;
+        anyCompression = anyCompression || compression[l] != 1.0;
+        length = std::max(length, lengths[l]);
       }
-    }
-
-    static constexpr int LoResNoisePeriod= 8;
-    static constexpr double MIN_LENGTH = 0.18;
 
-    BfxrParams _params;	// Params instance
+      // What reset(false) restores on a repeat, which is what a new synth starts with
+      const V repeatPeriod = LoadLanes<Ops>(synths, &BfxrSynth::_period);
+      const V repeatSlide = LoadLanes<Ops>(synths, &BfxrSynth::_slide);
+      const V repeatSquareDuty = W == WaveType::Square ? LoadLanes<Ops>(synths, &BfxrSynth::_squareDuty) : zero;
+
+      // Per sample state
+      V period = repeatPeriod;
+      V slide = repeatSlide;
+      V squareDuty = repeatSquareDuty;
+      V periodTemp = zero;
+      V phase = LoadLanes<Ops>(synths, &BfxrSynth::_phase);
+      V changePeriodTime = LoadLanes<Ops>(synths, &BfxrSynth::_changePeriodTime);
+      V changeTime = LoadLanes<Ops>(synths, &BfxrSynth::_changeTime);
+      V changeTime2 = LoadLanes<Ops>(synths, &BfxrSynth::_changeTime2);
+      V changeReached = LoadMask<Ops>(synths, &BfxrSynth::_changeReached);
+      V changeReached2 = LoadMask<Ops>(synths, &BfxrSynth::_changeReached2);
+      V repeatTime = LoadLanes<Ops>(synths, &BfxrSynth::_repeatTime);
+      V vibratoPhase = LoadLanes<Ops>(synths, &BfxrSynth::_vibratoPhase);
+      V envelopeVolume = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeVolume);
+      V envelopeStage = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeStage);
+      V envelopeTime = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeTime);
+      V envelopeLength = LoadLanes<Ops>(synths, &BfxrSynth::_envelopeLength);
+      V lpFilterPos = LoadLanes<Ops>(synths, &BfxrSynth::_lpFilterPos);
+      V lpFilterDeltaPos = LoadLanes<Ops>(synths, &BfxrSynth::_lpFilterDeltaPos);
+      V lpFilterCutoff = LoadLanes<Ops>(synths, &BfxrSynth::_lpFilterCutoff);
+      V hpFilterPos = LoadLanes<Ops>(synths, &BfxrSynth::_hpFilterPos);
+      V hpFilterCutoff = LoadLanes<Ops>(synths, &BfxrSynth::_hpFilterCutoff);
+      V bitcrushFreq = LoadLanes<Ops>(synths, &BfxrSynth::_bitcrush_freq);
+      V bitcrushPhase = LoadLanes<Ops>(synths, &BfxrSynth::_bitcrush_phase);
+      V bitcrushLast = LoadLanes<Ops>(synths, &BfxrSynth::_bitcrush_last);
+      V finished = LoadMask<Ops>(synths, &BfxrSynth::_finished);
+      V muted = LoadMask<Ops>(synths, &BfxrSynth::_muted);
+
+      double lanes[Width];
+      for(std::size_t i = 0; i < length; i += 1)
+      {
+        // Silence once the sound is muted or finished, the state of those lanes
+        // keeps going but is never looked at again
+        const V silent = Ops::Or(finished, muted);
+        if(!Ops::Any(Ops::AndNot(silent, all)))
+        {
+          break;
+        }
 
-    //--------------------------------------------------------------------------
-    //
-    //  Synth Variables
-    //
-    //--------------------------------------------------------------------------
+        // Repeats, partially resetting the sound parameters
+        repeatTime = Ops::Select(repeats, Ops::Add(repeatTime, one), repeatTime);
+        const V repeat = Ops::And(repeats, Ops::GreaterEqual(repeatTime, repeatLimit));
+        if(Ops::Any(repeat))
+        {
+          repeatTime = Ops::Select(repeat, zero, repeatTime);
+          period = Ops::Select(repeat, repeatPeriod, period);
+          slide = Ops::Select(repeat, repeatSlide, slide);
+          squareDuty = Ops::Select(repeat, repeatSquareDuty, squareDuty);
+          changePeriodTime = Ops::Select(repeat, zero, changePeriodTime);
+          changeTime = Ops::Select(repeat, zero, changeTime);
+          changeTime2 = Ops::Select(repeat, zero, changeTime2);
+          changeReached = Ops::AndNot(repeat, changeReached);
+          changeReached2 = Ops::AndNot(repeat, changeReached2);
+        }
 
-    bool _finished;						// If the sound has finished
+        changePeriodTime = Ops::Add(changePeriodTime, one);
+        const V changeRepeat = Ops::GreaterEqual(changePeriodTime, changePeriod);
+        changeTime = Ops::Select(changeRepeat, zero, changeTime);
+        changeTime2 = Ops::Select(changeRepeat, zero, changeTime2);
+        changePeriodTime = Ops::Select(changeRepeat, zero, changePeriodTime);
+        const V undo = Ops::And(changeRepeat, changeReached);
+        period = Ops::Select(undo, Ops::Div(period, changeAmount), period);
+        changeReached = Ops::AndNot(undo, changeReached);
+        const V undo2 = Ops::And(changeRepeat, changeReached2);
+        period = Ops::Select(undo2, Ops::Div(period, changeAmount2), period);
+        changeReached2 = Ops::AndNot(undo2, changeReached2);
+
+        // Shifts the pitch once the change limits are reached
+        const V counting = Ops::AndNot(changeReached, all);
+        changeTime = Ops::Select(counting, Ops::Add(changeTime, one), changeTime);
+        const V change = Ops::And(counting, Ops::GreaterEqual(changeTime, changeLimit));
+        changeReached = Ops::Or(changeReached, change);
+        period = Ops::Select(change, Ops::Mul(period, changeAmount), period);
+
+        const V counting2 = Ops::AndNot(changeReached2, all);
+        changeTime2 = Ops::Select(counting2, Ops::Add(changeTime2, one), changeTime2);
+        const V change2 = Ops::And(counting2, Ops::GreaterEqual(changeTime2, changeLimit2));
+        period = Ops::Select(change2, Ops::Mul(period, changeAmount2), period);
+        changeReached2 = Ops::Or(changeReached2, change2);
 
-    double _masterVolume;					// masterVolume * masterVolume (for quick calculations)
+        // Acccelerate and apply slide
+        slide = Ops::Add(slide, deltaSlide);
+        period = Ops::Mul(period, slide);
 
-    WaveType _waveType;							// The type of wave to generate
+        const V tooLow = Ops::Greater(period, maxPeriod);
+        period = Ops::Select(tooLow, maxPeriod, period);
+        muted = Ops::Or(muted, Ops::And(tooLow, Ops::Greater(minFrequency, zero)));
 
-    double _envelopeVolume;					// Current volume of the envelope
-    int _envelopeStage;						// Current stage of the envelope (attack, sustain, decay, end)
-    double _envelopeTime;					// Current time through current enelope stage
-    double _envelopeLength;					// Length of the current envelope stage
-    double _envelopeLength0;				// Length of the attack stage
-    double _envelopeLength1;				// Length of the sustain stage
-    double _envelopeLength2;				// Length of the decay stage
-    double _envelopeOverLength0;			// 1 / _envelopeLength0 (for quick calculations)
-    double _envelopeOverLength1;			// 1 / _envelopeLength1 (for quick calculations)
-    double _envelopeOverLength2;			// 1 / _envelopeLength2 (for quick calculations)
-    double _envelopeFullLength;				// Full length of the volume envelop (and therefore sound)
+        periodTemp = period;
+        if(anyVibrato)
+        {
+          vibratoPhase = Ops::Select(vibrato, Ops::Add(vibratoPhase, vibratoSpeed), vibratoPhase);
+          Ops::Store(lanes, vibratoPhase);
+          for(int l = 0; l < Width; l += 1) lanes[l] = fastMath ? FastSin(lanes[l]) : std::sin(lanes[l]);
+          const V sine = Ops::Load(lanes);
+          periodTemp = Ops::Select(vibrato, Ops::Mul(period, Ops::Add(one, Ops::Mul(sine, vibratoAmplitude))), period);
+        }
 
-    double _sustainPunch;					// The punch factor (louder at begining of sustain)
+        periodTemp = Ops::Trunc(periodTemp);
+        periodTemp = Ops::Select(Ops::Less(periodTemp, Ops::Set(8.0)), Ops::Set(8.0), periodTemp);
 
-    int _phase;								// Phase through the wave
-    double _pos;							// Phase expresed as a Number from 0-1, used for fast sin approx
-    double _period;							// Period of the wave
-    double _periodTemp;						// Period modified by vibrato
-    double _maxPeriod;						// Maximum period before sound stops (from minFrequency)
+        if(W == WaveType::Square)
+        {
+          squareDuty = Ops::Add(squareDuty, dutySweep);
+          squareDuty = Ops::Select(Ops::Less(squareDuty, zero), zero,
+              Ops::Select(Ops::Greater(squareDuty, Ops::Set(0.5)), Ops::Set(0.5), squareDuty));
+        }
 
-    double _slide;							// Note slide
-    double _deltaSlide;						// Change in slide
-    double _minFreqency;					// Minimum frequency before stopping
-    bool _muted;							// Whether or not min frequency has been attained
+        // Moves through the stages of the volume envelope
+        envelopeTime = Ops::Add(envelopeTime, one);
+        const V nextStage = Ops::Greater(envelopeTime, envelopeLength);
+        envelopeTime = Ops::Select(nextStage, zero, envelopeTime);
+        envelopeStage = Ops::Select(nextStage, Ops::Add(envelopeStage, one), envelopeStage);
+        envelopeLength = Ops::Select(Ops::And(nextStage, Ops::Equal(envelopeStage, one)), envelopeLength1,
+            Ops::Select(Ops::And(nextStage, Ops::Equal(envelopeStage, Ops::Set(2.0))), envelopeLength2, envelopeLength));
+
+        const V attack = Ops::Mul(envelopeTime, envelopeOverLength0);
+        const V sustain = Ops::Add(one, Ops::Mul(Ops::Mul(Ops::Sub(one, Ops::Mul(envelopeTime, envelopeOverLength1)), Ops::Set(2.0)), sustainPunch));
+        const V decay = Ops::Sub(one, Ops::Mul(envelopeTime, envelopeOverLength2));
+        const V ended = Ops::Equal(envelopeStage, Ops::Set(3.0));
+        envelopeVolume = Ops::Select(Ops::Equal(envelopeStage, zero), attack,
+            Ops::Select(Ops::Equal(envelopeStage, one), sustain,
+            Ops::Select(Ops::Equal(envelopeStage, Ops::Set(2.0)), decay,
+            Ops::Select(ended, zero, envelopeVolume))));
+        finished = Ops::Or(finished, ended);
 
+        // Moves the high-pass filter cutoff
+        if(anyFilters)
+        {
+          const V hpFilterSwept = Ops::Mul(hpFilterCutoff, hpFilterDeltaCutoff);
+          hpFilterCutoff = Ops::Select(hpFilterSweeps,
+              Ops::Select(Ops::Less(hpFilterSwept, hpFilterMinCutoff), hpFilterMinCutoff,
+              Ops::Select(Ops::Greater(hpFilterSwept, hpFilterMaxCutoff), hpFilterMaxCutoff, hpFilterSwept)),
+              hpFilterCutoff);
+        }
 
-    int _overtones;					// Minimum frequency before stopping
-    double _overtoneFalloff;					// Minimum frequency before stopping
+        V superSample = zero;
+        for(int j = 0; j < 8; j += 1)
+        {
+          phase = Ops::Add(phase, one);
+          phase = Ops::Select(Ops::GreaterEqual(phase, periodTemp), Ops::Sub(phase, periodTemp), phase);
+
+          // same phase accumulation as the scalar oscillator, the division of
+          // Mod() is only needed when the period just shrank below the phase
+          const V wrapped = Ops::GreaterEqual(phase, periodTemp);
+          const V basephase = Ops::Any(wrapped) ? Ops::Select(wrapped, Mod<Ops>(phase, periodTemp), phase) : phase;
+          V tempphase = zero;
+          V sample = zero;
+          V overtonestrength = one;
+          for(int k = 0; k <= maxOvertones; k += 1)
+          {
+            tempphase = Ops::Add(tempphase, basephase);
+            tempphase = Ops::Select(Ops::Less(tempphase, periodTemp), tempphase, Ops::Sub(tempphase, periodTemp));
+            const V value = WaveValue<Ops, W>(Ops::Div(tempphase, periodTemp), tempphase, periodTemp, squareDuty);
+            const V used = Ops::GreaterEqual(overtones, Ops::Set(k));
+            sample = Ops::Select(used, Ops::Add(sample, Ops::Mul(overtonestrength, value)), sample);
+            overtonestrength = Ops::Mul(overtonestrength, Ops::Sub(one, overtoneFalloff));
+          }
 
-    double _vibratoPhase;					// Phase through the vibrato sine wave
-    double _vibratoSpeed;					// Speed at which the vibrato phase moves
-    double _vibratoAmplitude;				// Amount to change the period of the wave by at the peak of the vibrato wave
+          // Applies the low and high pass filters
+          if(!anyFilters)
+          {
+            superSample = Ops::Add(superSample, sample);
+            continue;
+          }
 
-    double _changePeriod;
-    int _changePeriodTime;
+          const V lpFilterOldPos = lpFilterPos;
+          lpFilterCutoff = Ops::Mul(lpFilterCutoff, lpFilterDeltaCutoff);
+          lpFilterCutoff = Ops::Select(Ops::Less(lpFilterCutoff, zero), zero,
+              Ops::Select(Ops::Greater(lpFilterCutoff, lpFilterMaxCutoff), lpFilterMaxCutoff, lpFilterCutoff));
 
-    double _changeAmount;					// Amount to change the note by
-    int _changeTime;						// Counter for the note change
-    int _changeLimit;						// Once the time reaches this limit, the note changes
-    bool _changeReached;
+          const V moved = Ops::Mul(Ops::Add(lpFilterDeltaPos, Ops::Mul(Ops::Sub(sample, lpFilterPos), lpFilterCutoff)), lpFilterDamping);
+          lpFilterDeltaPos = Ops::Select(lpFilterOn, moved, zero);
+          lpFilterPos = Ops::Select(lpFilterOn, lpFilterPos, sample);
+          lpFilterPos = Ops::Add(lpFilterPos, lpFilterDeltaPos);
 
-    double _changeAmount2;					// Amount to change the note by
-    int _changeTime2;						// Counter for the note change
-    int _changeLimit2;						// Once the time reaches this limit, the note changes
-    bool _changeReached2;
+          hpFilterPos = Ops::Add(hpFilterPos, Ops::Sub(lpFilterPos, lpFilterOldPos));
+          hpFilterPos = Ops::Mul(hpFilterPos, Ops::Sub(one, hpFilterCutoff));
 
+          superSample = Ops::Add(superSample, Ops::Select(filters, hpFilterPos, sample));
+        }
 
-    double _squareDuty;						// Offset of center switching point in the square wave
-    double _dutySweep;						// Amount to change the duty by
+        // Clipping if too loud
+        superSample = Ops::Select(Ops::Greater(superSample, Ops::Set(8.0)), Ops::Set(8.0),
+            Ops::Select(Ops::Less(superSample, Ops::Set(-8.0)), Ops::Set(-8.0), superSample));
 
-    int _repeatTime;						// Counter for the repeats
-    int _repeatLimit;						// Once the time reaches this limit, some of the variables are reset
+        // Averages out the super samples and applies volumes
+        superSample = Ops::Mul(Ops::Mul(Ops::Mul(masterVolume, envelopeVolume), superSample), Ops::Set(0.125));
 
-    bool _flanger;						// If the flanger is active
-    double _flangerOffset;					// Phase offset for flanger effect
-    double _flangerDeltaOffset;				// Change in phase offset
-    int _flangerInt;							// Integer flanger offset, for bit maths
-    int _flangerPos;							// Position through the flanger buffer
-    std::vector<double> _flangerBuffer;			// Buffer of wave values used to create the out of phase second wave
+        // Bit crush
+        bitcrushPhase = Ops::Add(bitcrushPhase, bitcrushFreq);
+        const V crush = Ops::Greater(bitcrushPhase, one);
+        bitcrushPhase = Ops::Select(crush, zero, bitcrushPhase);
+        bitcrushLast = Ops::Select(crush, superSample, bitcrushLast);
+        const V swept = Ops::Add(bitcrushFreq, bitcrushFreqSweep);
+        const V capped = Ops::Select(Ops::Less(bitcrushMaxFreq, swept), bitcrushMaxFreq, swept);
+        bitcrushFreq = Ops::Select(Ops::Less(capped, zero), zero, capped);
 
-    bool _filters;						// If the filters are active
-    double _lpFilterPos;					// Adjusted wave position after low-pass filter
-    double _lpFilterOldPos;					// Previous low-pass wave position
-    double _lpFilterDeltaPos;				// Change in low-pass wave position, as allowed by the cutoff and damping
-    double _lpFilterCutoff;					// Cutoff multiplier which adjusts the amount the wave position can move
-    double _lpFilterDeltaCutoff;			// Speed of the low-pass cutoff multiplier
-    double _lpFilterDamping;				// Damping muliplier which restricts how fast the wave position can move
-    bool _lpFilterOn;					// If the low pass filter is active
+        superSample = bitcrushLast;
 
-    double _hpFilterPos;					// Adjusted wave position after high-pass filter
-    double _hpFilterCutoff;					// Cutoff multiplier which adjusts the amount the wave position can move
-    double _hpFilterDeltaCutoff;			// Speed of the high-pass cutoff multiplier
+        // Compressor, lane by lane
+        if(anyCompression)
+        {
+          Ops::Store(lanes, superSample);
+          for(int l = 0; l < Width; l += 1)
+          {
+            if(compression[l] == 1.0) continue;
+            const double x = lanes[l];
+            if(fastMath) lanes[l] = x > 0 ? FastPow(x, compression[l]) : -FastPow(-x, compression[l]);
+            else lanes[l] = x > 0 ? std::pow(x, compression[l]) : -std::pow(-x, compression[l]);
+          }
+          superSample = Ops::Load(lanes);
+        }
 
-    std::vector<double> _noiseBuffer;			// Buffer of random values used to generate noise
-    std::vector<double> _pinkNoiseBuffer;			// Buffer of random values used to generate noise
-    std::vector<double> _loResNoiseBuffer;			// Buffer of random values used to generate noise
+        superSample = Ops::Select(Ops::Or(muted, silent), zero, superSample);
 
-    int _oneBitNoiseState;					// Buffer containing one-bit periodic noise state.
-    double _oneBitNoise;					// Current sample of one-bit noise.
+        Ops::Store(lanes, superSample);
+        for(int l = 0; l < Width; l += 1)
+        {
+          if(i < lengths[l]) outs[l][i] = lanes[l];
+        }
+      }
+    }
 
-    int _buzzState;							// Buffer containing 'buzz' periodic noise state.
-    double _buzz;							// Current sample of 'buzz' noise.
+    template<WaveType W>
+    BFXR_TARGET_SSE2 BFXR_FLATTEN void RenderLanesSse2(BfxrSynth* const* synths, double* const* outs, const std::size_t* lengths)
+    {
+      RenderLanes<Sse2Ops<double>, W>(synths, outs, lengths);
+    }
 
-    PinkNoise _pinkNumber;
+    template<WaveType W>
+    BFXR_TARGET_AVX2 BFXR_FLATTEN void RenderLanesAvx2(BfxrSynth* const* synths, double* const* outs, const std::size_t* lengths)
+    {
+      RenderLanes<Avx2Ops<double>, W>(synths, outs, lengths);
+    }
 
-    // double _superSample;					// Actual sample writen to the wave
-    // double _sample;							// Sub-sample calculated 8 times per actual sample, averaged out to get the super sample
-    // unsigned int _sampleCount;						// Number of samples added to the buffer sample
-    // double _bufferSample;					// Another supersample used to create a 22050Hz wave
+    using LanesFunction = void (*)(BfxrSynth* const* synths, double* const* outs, const std::size_t* lengths);
 
-    double _bitcrush_freq;					// inversely proportional to the number of samples to skip 
-    double _bitcrush_freq_sweep;			// change of the above
-    double _bitcrush_phase;					// samples when this > 1
-    double _bitcrush_last;					// last sample value
+    template<WaveType W>
+    LanesFunction GetLanesFunction(SimdLevel level)
+    {
+      return level == SimdLevel::Avx2 ? &RenderLanesAvx2<W> : &RenderLanesSse2<W>;
+    }
 
-    double _compression_factor;
-  };
+    // Returns the batch renderer of the wave, or null if it has to be
+    // rendered by itself
+    LanesFunction GetLanesFunction(SimdLevel level, WaveType wave)
+    {
+      if(level == SimdLevel::Scalar) return nullptr;
+      switch(wave)
+      {
+        case WaveType::Square: return GetLanesFunction<WaveType::Square>(level);
+        case WaveType::Saw: return GetLanesFunction<WaveType::Saw>(level);
+        case WaveType::Sin: return GetLanesFunction<WaveType::Sin>(level);
+        case WaveType::Triangle: return GetLanesFunction<WaveType::Triangle>(level);
+        case WaveType::Whistle: return GetLanesFunction<WaveType::Whistle>(level);
+        case WaveType::Breaker: return GetLanesFunction<WaveType::Breaker>(level);
+        default: return nullptr;
+      }
+    }
+  }
+#endif // BFXR_SIMD_X86
 
-  void GenerateSound(const BfxrParams& params, std::vector<double>* data)
+  void GenerateSounds(const std::vector<BfxrParams>& params, std::vector<std::vector<double>>* sounds, const RenderSettings& settings)
   {
-    BfxrSynth synth{params};
-    synth.GenerateSound(data);
+    sounds->assign(params.size(), std::vector<double>());
+
+    std::vector<BfxrSynth> synths;
+    synths.reserve(params.size());
+    for(const auto& p : params)
+    {
+      synths.emplace_back(p, settings);
+    }
+    std::vector<bool> rendered(params.size(), false);
+
+#ifdef BFXR_SIMD_X86
+    // Groups the sounds that can share a batch by wave
+    const int width = settings.simdLevel == SimdLevel::Avx2 ? 4 : 2;
+    for(int wave = 0; wave < static_cast<int>(WaveType::COUNT); wave += 1)
+    {
+      const auto lanes = detail::GetLanesFunction(settings.simdLevel, static_cast<WaveType>(wave));
+      if(lanes == nullptr || settings.precision != Precision::Double) continue;
+
+      std::vector<std::size_t> group;
+      for(std::size_t i = 0; i < synths.size(); i += 1)
+      {
+        const auto& synth = synths[i];
+        if(static_cast<int>(synth._waveType) == wave && !synth._flanger && synth._holdShift == 0)
+        {
+          group.push_back(i);
+        }
+      }
+
+      // sounds of about the same length share a batch so fewer lanes idle
+      std::stable_sort(group.begin(), group.end(), [&](std::size_t a, std::size_t b)
+      {
+        return synths[a].GetNumberOfSamples() < synths[b].GetNumberOfSamples();
+      });
+
+      for(std::size_t start = 0; start < group.size(); start += width)
+      {
+        BfxrSynth* batch[4];
+        double* outs[4];
+        std::size_t lengths[4];
+        for(int l = 0; l < width; l += 1)
+        {
+          // the lanes past the end of the group repeat its last sound and
+          // aren't written anywhere
+          const bool used = start + l < group.size();
+          const std::size_t index = group[used ? start + l : group.size() - 1];
+          batch[l] = &synths[index];
+          lengths[l] = used ? synths[index].GetNumberOfSamples() : 0;
+          if(used) (*sounds)[index].resize(lengths[l]);
+          outs[l] = used ? (*sounds)[index].data() : nullptr;
+        }
+        lanes(batch, outs, lengths);
+
+        for(int l = 0; l < width && start + l < group.size(); l += 1)
+        {
+          const std::size_t index = group[start + l];
+          TrimSilence(&(*sounds)[index]);
+          rendered[index] = true;
+        }
+      }
+    }
+#endif
+
+    for(std::size_t i = 0; i < synths.size(); i += 1)
+    {
+      if(!rendered[i])
+      {
+        synths[i].GenerateSound(&(*sounds)[i]);
+      }
+    }
   }
 
 
 
 
-  bool SaveWav(const char* filename, const std::vector<double>& data)
+  bool SaveWav(const char* filename, const std::vector<double>& data, int sampleRate)
   {
     const int wav_bits=16;
-    const int wav_freq=44100;
+    const int wav_freq=sampleRate;
 
     FILE* foutput=fopen(filename, "wb");
     if(!foutput)
@@ -1496,7 +3951,6 @@ namespace bfxr
       auto ssample = sample;
 			if(ssample>1.0) ssample=1.0;
 			if(ssample<-1.0) ssample=-1.0;
-			assert(wav_freq==44100);
       const auto filesample = ssample;
       if(wav_bits==16)
       {
@@ -1524,6 +3978,61 @@ namespace bfxr
     return true;
   }
 
+  void Resample(const std::vector<double>& input, int inputRate, std::vector<double>* output, int outputRate)
+  {
+    assert(inputRate > 0 && outputRate > 0);
+    output->clear();
+    if(input.empty()) return;
+    if(inputRate == outputRate)
+    {
+      *output = input;
+      return;
+    }
+
+    const double pi = 3.14159265358979323846;
+    const int zeroCrossings = 16;
+
+    // input samples per output sample, and the cutoff relative to the input
+    // nyquist frequency that is lowered when downsampling to avoid aliasing
+    const double step = static_cast<double>(inputRate) / outputRate;
+    const double cutoff = std::min(1.0, 1.0 / step);
+    const double halfWidth = zeroCrossings / cutoff;
+    const auto last = static_cast<long long>(input.size()) - 1;
+
+    output->resize(static_cast<std::size_t>(std::ceil(input.size() / step)));
+    for(std::size_t i=0; i<output->size(); i+=1)
+    {
+      const double center = i * step;
+      const auto begin = std::max<long long>(0, static_cast<long long>(std::ceil(center - halfWidth)));
+      const auto end = std::min<long long>(last, static_cast<long long>(std::floor(center + halfWidth)));
+
+      double sum = 0.0;
+      for(auto k=begin; k<=end; k+=1)
+      {
+        const double x = k - center;
+        const double window = 0.5 + 0.5 * std::cos(pi * x / halfWidth);
+        const double sinc = x == 0.0 ? 1.0 : std::sin(pi * cutoff * x) / (pi * cutoff * x);
+        sum += input[static_cast<std::size_t>(k)] * cutoff * sinc * window;
+      }
+      (*output)[i] = sum;
+    }
+  }
+
+  void FloatToS16(const float* in, std::int16_t* out, std::size_t n, SimdLevel level)
+  {
+#ifdef BFXR_SIMD_X86
+    switch(level)
+    {
+      case SimdLevel::Sse2: detail::FloatToS16Sse2(in, out, n); return;
+      case SimdLevel::Avx2: detail::FloatToS16Avx2(in, out, n); return;
+      default: break;
+    }
+#else
+    (void)level;
+#endif
+    detail::FloatToS16Scalar(in, out, n);
+  }
+
 }
 
 #endif // BFXR_IMPLEMENTATION
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstdlib>
 #include <sstream>
 #include <vector>
 #include <map>
@@ -6,6 +7,12 @@
 #include <cmath>
 #include <set>
 #include <memory>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <glad/glad.h>
 #include "imgui.h"
@@ -30,7 +37,6 @@ const float pi = 3.14159f;
 #undef max
 #endif
 
-#define BFXR_IMPLEMENTATION
 #include "bfxr.h"
 #include "bfxr_lang_en.h"
 
@@ -56,11 +62,61 @@ bool hasEnding (std::string const &fullString, std::string const &ending) {
     }
 }
 
+// Queue between one producer and one consumer thread, holds Size - 1 items.
+// Neither locks nor allocates so the audio callback can use it
+template<typename T, std::size_t Size>
+class SpscQueue
+{
+ public:
+  bool
+  Push(const T& item)
+  {
+    const auto tail = write.load(std::memory_order_relaxed);
+    const auto next = (tail + 1) % Size;
+    if(next == read.load(std::memory_order_acquire)) { return false; }
+    items[tail] = item;
+    write.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool
+  Pop(T* item)
+  {
+    const auto head = read.load(std::memory_order_relaxed);
+    if(head == write.load(std::memory_order_acquire)) { return false; }
+    *item = items[head];
+    read.store((head + 1) % Size, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  T items[Size];
+  std::atomic<std::size_t> read{0};
+  std::atomic<std::size_t> write{0};
+};
+
+// Device buffer sizes in samples, SDL wants powers of two
+const int audio_buffer_sizes[] = {128, 256, 512, 1024, 2048, 4096};
+
+// The smallest of them that holds samples, the largest one otherwise
+int
+AudioBufferSize(int samples)
+{
+  int size = 0;
+  for(const int candidate : audio_buffer_sizes)
+  {
+    size = candidate;
+    if(size >= samples) { break; }
+  }
+  return size;
+}
+
 class AppBase
 {
  public:
-  AppBase()
+  AppBase(bool float_output, int buffer_samples)
       : ok(true)
+      , float_output(float_output)
   {
     if(SDL_Init(SDL_INIT_EVERYTHING) < 0)
     {
@@ -71,7 +127,16 @@ class AppBase
     }
 
     SetupWindow("bfxr");
-    SetupAudioCallbacks();
+    if(!OpenAudio("", buffer_samples))
+    {
+      ok = false;
+    }
+
+    int i, count = SDL_GetNumAudioDevices(0);
+    for(i = 0; i < count; ++i)
+    {
+      SDL_Log("Audio device %d: %s", i, SDL_GetAudioDeviceName(i, 0));
+    }
   }
 
   void
@@ -198,31 +263,73 @@ class AppBase
     // IM_ASSERT(font != NULL);
   }
 
-  void
-  SetupAudioCallbacks()
+  // Opens the device paused, an empty name is the default device. The device
+  // may pick another buffer size, audio_spec has the one it uses
+  bool
+  OpenAudio(const std::string& device, int buffer_samples)
   {
     SDL_AudioSpec spec;
     SDL_memset(&spec, 0, sizeof(spec));
     spec.freq     = sample_frequency;
-    spec.format   = AUDIO_S16SYS;
+    spec.format   = float_output ? AUDIO_F32SYS : AUDIO_S16SYS;
     spec.channels = 1;
-    spec.samples  = 1024;
+    spec.samples  = static_cast<Uint16>(AudioBufferSize(buffer_samples));
     spec.callback = SDLAudioCallback;
     spec.userdata = this;
 
-    if(0 != SDL_OpenAudio(&spec, nullptr))
+    // SDL converts the format and rate, but rebuffering to another size would
+    // add its own latency on top of the buffer
+    audio_device = SDL_OpenAudioDevice(
+        device.empty() ? nullptr : device.c_str(),
+        0,
+        &spec,
+        &audio_spec,
+        SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if(audio_device == 0)
     {
       SDL_LogError(
           SDL_LOG_CATEGORY_APPLICATION,
           "Failed to setup audio: %s",
           SDL_GetError());
-      ok = false;
+      return false;
     }
 
-    int i, count = SDL_GetNumAudioDevices(0);
-    for(i = 0; i < count; ++i)
+    audio_device_name = device;
+    audio_buffer_size = spec.samples;
+    stream_buffer.resize(audio_spec.samples);
+    ResetAudioStats();
+    SDL_Log(
+        "Audio device %s: %d samples at %d Hz",
+        device.empty() ? "(default)" : device.c_str(),
+        audio_spec.samples,
+        audio_spec.freq);
+    return true;
+  }
+
+  // Switches device or buffer size while running, what is playing carries on
+  // where it was. Falls back to the default device when the new one fails
+  bool
+  ReopenAudio(const std::string& device, int buffer_samples)
+  {
+    CloseAudio();
+    const bool opened = OpenAudio(device, buffer_samples) ||
+                        (!device.empty() && OpenAudio("", buffer_samples));
+    if(opened)
     {
-      SDL_Log("Audio device %d: %s", i, SDL_GetAudioDeviceName(i, 0));
+      SDL_PauseAudioDevice(audio_device, 0);
+    }
+    return opened;
+  }
+
+  // Waits for the callback to finish, after that it doesn't run until the
+  // device is opened again
+  void
+  CloseAudio()
+  {
+    if(audio_device != 0)
+    {
+      SDL_CloseAudioDevice(audio_device);
+      audio_device = 0;
     }
   }
 
@@ -231,12 +338,19 @@ class AppBase
   {
     if(ok)
     {
-      SDL_PauseAudio(0);
+      SDL_PauseAudioDevice(audio_device, 0);
     }
   }
 
   ~AppBase()
   {
+    // after closing everything the callback played is ours
+    CloseAudio();
+    FreeFinished();
+    Playback* queued = nullptr;
+    while(to_audio.Pop(&queued)) { delete queued; }
+    delete playing;
+
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -249,9 +363,6 @@ class AppBase
   virtual void
   Draw() = 0;
 
-  virtual float
-  SynthSample(int time) = 0;
-
   void
   OnRender()
   {
@@ -278,38 +389,142 @@ class AppBase
   void
   AudioCallback(Uint8* stream, int bytes)
   {
-    const int len    = bytes / 2;
-    auto*     output = reinterpret_cast<Sint16*>(stream);
+    const Uint64 start = SDL_GetPerformanceCounter();
+    const int    len   = bytes / (float_output ? 4 : 2);
 
-    const Sint16 max_amplitude = 32767;
+    // switches to the newest sound, the ones it replaces go back to the ui
+    // thread to be freed, freeing here could block on the allocator
+    Playback* next = nullptr;
+    while(to_audio.Pop(&next))
+    {
+      if(playing != nullptr) { finished.Push(playing); }
+      playing = next;
+      MeasureLatency(start, playing->sent, len);
+    }
 
-    for(int i = 0; i < len; i += 1)
+    if(float_output)
     {
-      const auto sample_time = sample_position + i;
-      float sample = 0.0f;
-      if(sample_time >= sample_length )
-      {
-        sample = 0;
-      }
-      else
+      FillBlock(reinterpret_cast<float*>(stream), len);
+    }
+    else
+    {
+      auto*     output = reinterpret_cast<Sint16*>(stream);
+      const int block  = static_cast<int>(stream_buffer.size());
+      for(int i = 0; i < len; i += block)
       {
-        sample = SynthSample(sample_time);
+        const int count = std::min(block, len - i);
+        FillBlock(stream_buffer.data(), count);
+        bfxr::FloatToS16(stream_buffer.data(), output + i, count, simd_level);
       }
-      if(sample > 1)
+    }
+
+    MeasureCallback(start, len);
+  }
+
+  // A sound is heard once the buffer it starts in has played, after the one
+  // the device is playing now. What the driver and the hardware add on top
+  // isn't visible from here
+  void
+  MeasureLatency(Uint64 callback_start, Uint64 sent, int samples)
+  {
+    if(sent == 0) { return; }
+    const float waited = TicksToMs(callback_start - sent);
+    output_latency.store(
+        waited + BufferMs(samples), std::memory_order_relaxed);
+  }
+
+  // Compares the time between callbacks and the time each one takes with the
+  // time the device needs to play one buffer. A callback coming more than
+  // half a buffer late most likely left the device without samples, one
+  // taking longer than a buffer surely did
+  void
+  MeasureCallback(Uint64 start, int samples)
+  {
+    if(reset_audio_stats.exchange(false, std::memory_order_relaxed))
+    {
+      ResetAudioStats();
+    }
+
+    const float period = BufferMs(samples);
+    const float took   = TicksToMs(SDL_GetPerformanceCounter() - start);
+
+    if(last_callback != 0)
+    {
+      const float jitter = std::abs(TicksToMs(start - last_callback) - period);
+      const float smooth = callback_jitter.load(std::memory_order_relaxed);
+      callback_jitter.store(smooth + (jitter - smooth) * 0.05f, std::memory_order_relaxed);
+      if(jitter > max_callback_jitter.load(std::memory_order_relaxed))
       {
-        sample = 1;
+        max_callback_jitter.store(jitter, std::memory_order_relaxed);
       }
-      if(sample < -1)
+      if(TicksToMs(start - last_callback) > period * 1.5f)
       {
-        sample = -1;
+        late_callbacks.fetch_add(1, std::memory_order_relaxed);
       }
-      output[i]       = static_cast<Sint16>(max_amplitude * sample);
     }
+    last_callback = start;
 
-    if(sample_position <= sample_length )
+    if(took > period)
+    {
+      slow_callbacks.fetch_add(1, std::memory_order_relaxed);
+    }
+    audio_callback_time.store(took, std::memory_order_relaxed);
+    if(took > max_callback_time.load(std::memory_order_relaxed))
     {
-      sample_position += len;
+      max_callback_time.store(took, std::memory_order_relaxed);
     }
+    samples_consumed.fetch_add(samples, std::memory_order_relaxed);
+  }
+
+  // Only while the callback isn't running, the ui asks for it through
+  // reset_audio_stats instead
+  void
+  ResetAudioStats()
+  {
+    last_callback = 0;
+    audio_callback_time.store(0, std::memory_order_relaxed);
+    max_callback_time.store(0, std::memory_order_relaxed);
+    callback_jitter.store(0, std::memory_order_relaxed);
+    max_callback_jitter.store(0, std::memory_order_relaxed);
+    output_latency.store(0, std::memory_order_relaxed);
+    late_callbacks.store(0, std::memory_order_relaxed);
+    slow_callbacks.store(0, std::memory_order_relaxed);
+    samples_consumed.store(0, std::memory_order_relaxed);
+  }
+
+  float
+  TicksToMs(Uint64 ticks) const
+  {
+    return static_cast<float>(ticks * 1000.0 / SDL_GetPerformanceFrequency());
+  }
+
+  float
+  BufferMs(int samples) const
+  {
+    return 1000.0f * samples / audio_spec.freq;
+  }
+
+  // Writes the next count samples of what is playing, silence after the end
+  void
+  FillBlock(float* out, int count)
+  {
+    int written = 0;
+    if(playing != nullptr && playing->synth)
+    {
+      written = static_cast<int>(playing->synth->renderBlock(out, count));
+    }
+    else if(playing != nullptr && playing->samples)
+    {
+      const auto& samples = *playing->samples;
+      while(written < count && playing->position < samples.size())
+      {
+        out[written] = static_cast<float>(samples[playing->position]);
+        written += 1;
+        playing->position += 1;
+      }
+    }
+
+    std::fill(out + written, out + count, 0.0f);
   }
 
   static void
@@ -322,31 +537,186 @@ class AppBase
  public:
   bool ok;
 
-  void PlaySound(int samples)
+  // Plays rendered samples, the callback keeps its own reference so the
+  // samples stay alive while it plays them
+  void PlaySound(std::shared_ptr<const std::vector<double>> samples, std::size_t from = 0)
+  {
+    auto* playback = new Playback();
+    playback->samples = std::move(samples);
+    playback->position = from;
+    SendToAudio(playback);
+  }
+
+  // Plays a synth by rendering it in the callback
+  void PlaySynth(std::unique_ptr<bfxr::BfxrSynth> synth)
+  {
+    auto* playback = new Playback();
+    playback->synth = std::move(synth);
+    SendToAudio(playback);
+  }
+
+  void StopSound()
+  {
+    SendToAudio(new Playback());
+  }
+
+  // Frees what the callback is done with, called every frame
+  void FreeFinished()
+  {
+    Playback* done = nullptr;
+    while(finished.Pop(&done)) { delete done; }
+  }
+
+ private:
+  // What the callback plays, either rendered samples or a synth. Once sent
+  // only the callback touches it until it comes back through finished
+  struct Playback
   {
-    sample_position = 0;
-    sample_length = samples;
+    std::shared_ptr<const std::vector<double>> samples;
+    std::size_t position = 0;
+    std::unique_ptr<bfxr::BfxrSynth> synth;
+    Uint64 sent = 0;	// performance counter, stopping isn't timed
+  };
+
+  void SendToAudio(Playback* playback)
+  {
+    if(playback->samples || playback->synth)
+    {
+      playback->sent = SDL_GetPerformanceCounter();
+    }
+    // the callback only passes on as many as were sent, with finished
+    // emptied first there is always room for them
+    FreeFinished();
+    if(!to_audio.Push(playback))
+    {
+      // the callback hasn't run for 7 sounds, drop this one
+      delete playback;
+    }
   }
 
+  SpscQueue<Playback*, 8> to_audio;
+  SpscQueue<Playback*, 16> finished;
+  Playback* playing = nullptr;	// only used by the callback
+
+  // samples are handed to the device as they are, without converting them
+  bool float_output;
+  bfxr::SimdLevel simd_level = bfxr::DetectSimdLevel();
+
  protected:
-  int sample_position     = 0;
-  int sample_length = 0;
   int   sample_frequency    = 44100;
-  float audio_callback_time = 0;
-  int   samples_consumed    = 0;
+  std::vector<float> stream_buffer;
+
+  SDL_AudioDeviceID audio_device = 0;
+  SDL_AudioSpec     audio_spec   = {};
+  std::string       audio_device_name;	// empty for the default device
+  int               audio_buffer_size = 1024;	// what was asked for
+
+  // Written by the callback and read by the ui, each on its own. Times are in
+  // milliseconds
+  std::atomic<float>         audio_callback_time{0};	// the last callback
+  std::atomic<float>         max_callback_time{0};
+  std::atomic<float>         callback_jitter{0};	// smoothed
+  std::atomic<float>         max_callback_jitter{0};
+  std::atomic<float>         output_latency{0};	// of the last sound sent
+  std::atomic<int>           late_callbacks{0};
+  std::atomic<int>           slow_callbacks{0};
+  std::atomic<std::uint64_t> samples_consumed{0};
+  std::atomic<bool>          reset_audio_stats{false};
+  Uint64 last_callback = 0;	// only used by the callback
 
  public:
   SDL_Window*   window;
   SDL_GLContext gl_context;
 };
 
-namespace {
-  float double_to_float(void* data, int idx)
+// Min and max of a sound over buckets of 2, 4, 8... samples. Built once per
+// render so drawing the waveform costs as much as the plot is wide instead of
+// as long as the sound
+class PeakPyramid
+{
+ public:
+  void
+  Build(const std::vector<double>& samples)
   {
-    auto* arr = static_cast<std::vector<double>*>(data);
-    return (*arr)[idx];
+    base.assign(samples.begin(), samples.end());
+    levels.clear();
+    while(Count(levels.size()) > 1)
+    {
+      const std::size_t below = levels.size();
+      const std::size_t count = (Count(below) + 1) / 2;
+      Level level;
+      level.min.resize(count);
+      level.max.resize(count);
+      for(std::size_t i = 0; i < count; i += 1)
+      {
+        // an odd bucket at the end only has itself
+        const std::size_t a = i * 2;
+        const std::size_t b = std::min(a + 1, Count(below) - 1);
+        level.min[i] = std::min(Min(below, a), Min(below, b));
+        level.max[i] = std::max(Max(below, a), Max(below, b));
+      }
+      levels.push_back(std::move(level));
+    }
   }
-}
+
+  std::size_t
+  Size() const
+  {
+    return base.size();
+  }
+
+  float
+  Sample(std::size_t index) const
+  {
+    return base[index];
+  }
+
+  // Min and max of the samples in [begin, end), from the largest aligned
+  // buckets that fit in the range. That is at most two per level, so it
+  // costs the log of the range and never reaches past it
+  void
+  Range(std::size_t begin, std::size_t end, float* min, float* max) const
+  {
+    end = std::min(end, base.size());
+    if(begin >= end)
+    {
+      *min = *max = 0.0f;
+      return;
+    }
+
+    *min = base[begin];
+    *max = base[begin];
+    while(begin < end)
+    {
+      std::size_t depth = 0;
+      while(depth < levels.size() && begin % (std::size_t(2) << depth) == 0 &&
+            begin + (std::size_t(2) << depth) <= end)
+      {
+        depth += 1;
+      }
+
+      const std::size_t bucket = begin >> depth;
+      *min = std::min(*min, Min(depth, bucket));
+      *max = std::max(*max, Max(depth, bucket));
+      begin += std::size_t(1) << depth;
+    }
+  }
+
+ private:
+  struct Level
+  {
+    std::vector<float> min;
+    std::vector<float> max;
+  };
+
+  // depth 0 is the samples themselves, depth n has buckets of 2^n samples
+  std::size_t Count(std::size_t depth) const { return depth == 0 ? base.size() : levels[depth - 1].min.size(); }
+  float Min(std::size_t depth, std::size_t i) const { return depth == 0 ? base[i] : levels[depth - 1].min[i]; }
+  float Max(std::size_t depth, std::size_t i) const { return depth == 0 ? base[i] : levels[depth - 1].max[i]; }
+
+  std::vector<float> base;
+  std::vector<Level> levels;
+};
 
 
       bool radio(const char* str, bfxr::WaveType* val, bfxr::WaveType wt)
@@ -356,19 +726,356 @@ namespace {
         if(ImGui::Button(*b ? ICON_FK_LOCK : ICON_FK_UNLOCK )) { *b = !*b; }
       }
 
+// What the generator, randomize and mutate buttons do to the params
+enum class Generator
+{
+  PickupCoin,
+  LaserShoot,
+  Explosion,
+  Powerup,
+  HitHurt,
+  Jump,
+  BlipSelect,
+  Randomize,
+  Mutate,
+  COUNT
+};
+
+void Generate(Generator generator, bfxr::BfxrParams* params, bfxr::Random& random)
+{
+  switch(generator)
+  {
+    case Generator::PickupCoin: params->generatePickupCoin(random); break;
+    case Generator::LaserShoot: params->generateLaserShoot(random); break;
+    case Generator::Explosion: params->generateExplosion(random); break;
+    case Generator::Powerup: params->generatePowerup(random); break;
+    case Generator::HitHurt: params->generateHitHurt(random); break;
+    case Generator::Jump: params->generateJump(random); break;
+    case Generator::BlipSelect: params->generateBlipSelect(random); break;
+    case Generator::Randomize: params->randomize(random); break;
+    case Generator::Mutate: params->mutate(random); break;
+    case Generator::COUNT: break;
+  }
+}
+
+// Rolls the next results of the buttons on a background thread and renders
+// them into the cache, like CacheMutations() of the flash version, so a click
+// plays a sound that is already rendered. The generators start from scratch
+// and their results are kept until taken, mutate and randomize start from
+// the current params and their results are thrown away when those change,
+// which taking one of them does
+class Speculator
+{
+ public:
+  Speculator(bfxr::RenderCache* cache, const bfxr::RenderSettings& settings)
+      : cache(cache)
+      , settings(settings)
+      , random(1)
+      , worker(&Speculator::Run, this)
+  {
+  }
+
+  ~Speculator()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  // Called with the current params every frame, restarts the mutations
+  // when they have changed
+  void
+  SetBase(const bfxr::BfxrParams& params)
+  {
+    auto serialized = params.serialize();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if(serialized == base_serialized) { return; }
+      base_serialized.swap(serialized);
+      base = params;
+      generation.fetch_add(1);
+      ready[static_cast<int>(Generator::Randomize)].clear();
+      ready[static_cast<int>(Generator::Mutate)].clear();
+    }
+    wake.notify_one();
+  }
+
+  // Takes the next rolled result, returns false if there is none yet
+  bool
+  Take(Generator generator, bfxr::BfxrParams* params)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto& results = ready[static_cast<int>(generator)];
+      if(results.empty()) { return false; }
+      *params = results.front();
+      results.pop_front();
+    }
+    wake.notify_one();
+    return true;
+  }
+
+ private:
+  // How many results to keep ready. A mutate or randomize result changes the
+  // params and so throws away the others, only one of them is worth rendering
+  static std::size_t
+  Target(Generator generator)
+  {
+    return DependsOnBase(generator) ? 1 : MaxTarget;
+  }
+
+  static bool
+  DependsOnBase(Generator generator)
+  {
+    return generator == Generator::Randomize || generator == Generator::Mutate;
+  }
+
+  // Fills every button up to one result before filling them up to the
+  // target, mutate first
+  bool
+  NextJob(Generator* generator)
+  {
+    for(std::size_t wanted = 1; wanted <= MaxTarget; wanted += 1)
+    {
+      for(int i = static_cast<int>(Generator::COUNT) - 1; i >= 0; i -= 1)
+      {
+        const auto g = static_cast<Generator>(i);
+        if(ready[i].size() < std::min(wanted, Target(g)))
+        {
+          *generator = g;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  void
+  Run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(running)
+    {
+      Generator generator;
+      if(!NextJob(&generator))
+      {
+        wake.wait(lock);
+        continue;
+      }
+
+      bfxr::BfxrParams params = base;
+      const auto started = generation.load();
+      lock.unlock();
+      Generate(generator, &params, random);
+      const bool rendered = Render(params, DependsOnBase(generator) ? started : 0);
+      lock.lock();
+
+      if(rendered && (!DependsOnBase(generator) || started == generation.load()))
+      {
+        ready[static_cast<int>(generator)].push_back(params);
+      }
+    }
+  }
+
+  // Renders into the cache like RenderCache::get, a result that depends on
+  // the base is dropped as soon as the base changes instead of holding up the
+  // next one. started is 0 for the others
+  bool
+  Render(const bfxr::BfxrParams& params, std::uint64_t started)
+  {
+    if(cache->find(params, settings)) { return true; }
+
+    bfxr::BfxrSynth synth{params, settings};
+    std::vector<double> samples;
+    const auto cancelled = [&]() { return started != 0 && generation.load() != started; };
+    if(!synth.GenerateSound(&samples, nullptr, cancelled)) { return false; }
+    cache->insert(params, settings, std::move(samples));
+    return true;
+  }
+
+  static constexpr std::size_t MaxTarget = 2;
+
+  bfxr::RenderCache* cache;
+  bfxr::RenderSettings settings;
+  bfxr::Random random;	// only used by the worker
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool running = true;
+  std::string base_serialized;
+  bfxr::BfxrParams base;
+  std::atomic<std::uint64_t> generation{1};	// checked while rendering, never 0
+  std::deque<bfxr::BfxrParams> ready[static_cast<int>(Generator::COUNT)];
+
+  std::thread worker;
+};
+
+constexpr std::size_t Speculator::MaxTarget;
+
+// Renders sounds on a background thread so the ui never waits for the synth.
+// Only the latest request matters: it replaces the one that is waiting and
+// cancels the one being rendered, so dragging a slider renders where it is
+// now instead of every value along the way
+class Synthesizer
+{
+ public:
+  struct Sound
+  {
+    bfxr::BfxrParams params;
+    std::shared_ptr<const std::vector<double>> samples;
+    bfxr::SynthCheckpoints checkpoints;
+    bool play = false;
+  };
+
+  explicit Synthesizer(bfxr::RenderCache* cache)
+      : cache(cache)
+      , worker(&Synthesizer::Run, this)
+  {
+  }
+
+  ~Synthesizer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running = false;
+      latest += 1;
+    }
+    wake.notify_one();
+    worker.join();
+  }
+
+  void
+  Request(const bfxr::BfxrParams& params, const bfxr::RenderSettings& settings, bool play)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending.params = params;
+      pending.settings = settings;
+      pending.play = play;
+      pending.generation = latest.fetch_add(1) + 1;
+      has_pending = true;
+      has_finished = false;
+    }
+    wake.notify_one();
+  }
+
+  // Forgets the sound that is waiting or being rendered
+  void
+  Cancel()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    latest += 1;
+    has_pending = false;
+    has_finished = false;
+  }
+
+  // Hands over the sound of the latest request once it is rendered
+  bool
+  Poll(Sound* sound)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!has_finished) { return false; }
+    *sound = std::move(finished);
+    has_finished = false;
+    return true;
+  }
+
+  // True until the sound of the latest request is polled
+  bool
+  Busy() const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return has_pending || rendering == latest || has_finished;
+  }
+
+ private:
+  struct Job
+  {
+    bfxr::BfxrParams params;
+    bfxr::RenderSettings settings;
+    bool play = false;
+    std::uint64_t generation = 0;
+  };
+
+  void
+  Run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(running)
+    {
+      if(!has_pending)
+      {
+        wake.wait(lock);
+        continue;
+      }
+
+      const Job job = pending;
+      has_pending = false;
+      rendering = job.generation;
+      lock.unlock();
+
+      Sound sound;
+      sound.params = job.params;
+      sound.play = job.play;
+      bfxr::BfxrSynth synth{job.params, job.settings};
+      std::vector<double> samples;
+      const auto cancelled = [&]() { return latest.load() != job.generation; };
+      const bool done = synth.GenerateSound(&samples, &sound.checkpoints, cancelled);
+      if(done)
+      {
+        sound.samples = cache->insert(job.params, job.settings, std::move(samples));
+      }
+
+      lock.lock();
+      rendering = 0;
+      if(done && job.generation == latest.load())
+      {
+        finished = std::move(sound);
+        has_finished = true;
+      }
+    }
+  }
+
+  bfxr::RenderCache* cache;
+
+  mutable std::mutex mutex;
+  std::condition_variable wake;
+  bool running = true;
+  std::atomic<std::uint64_t> latest{0};	// checked while rendering to cancel
+  std::uint64_t rendering = 0;
+  Job pending;
+  bool has_pending = false;
+  Sound finished;
+  bool has_finished = false;
+
+  std::thread worker;
+};
+
 class App : public AppBase
 {
  public:
-  App()
+  App(bool float_output, int buffer_samples)
+      : AppBase(float_output, buffer_samples)
   {
   }
 
+  ~App()
+  {
+    SDL_PauseAudioDevice(audio_device, 1);
+  }
+
   // grab from cmdline or something...
   bool dev = false;
 
   void
   Draw() override
   {
+    FreeFinished();
+    PollSynthesizer();
+
     // imgui: demo window
     if(dev)
     {
@@ -412,40 +1119,51 @@ class App : public AppBase
       bool sound_changed = false;
 
 #define BTN(TEXT, DESC, CODE) if(ImGui::Button(TEXT)) { sound_changed = true; CODE; } ImGui::SameLine(); ShowHelpMarker(DESC);
-      BTN(TEXT_BTN_PICKUP_COIN, TEXT_BTN_PICKUP_COIN_DESCRIPTION, param.generatePickupCoin() ) ImGui::SameLine();
-      BTN(TEXT_BTN_LASER_SHOOT, TEXT_BTN_LASER_SHOOT_DESCRIPTION, param.generateLaserShoot() ) ImGui::SameLine();
-      BTN(TEXT_BTN_EXPLOSION, TEXT_BTN_EXPLOSION_DESCRIPTION, param.generateExplosion() ) ImGui::SameLine();
-      BTN(TEXT_BTN_POWERUP, TEXT_BTN_POWERUP_DESCRIPTION, param.generatePowerup() ) ImGui::SameLine();
-      BTN(TEXT_BTN_HIT_HURT, TEXT_BTN_HIT_HURT_DESCRIPTION, param.generateHitHurt() ) ImGui::SameLine();
-      BTN(TEXT_BTN_JUMP, TEXT_BTN_JUMP_DESCRIPTION, param.generateJump() ) ImGui::SameLine();
-      BTN(TEXT_BTN_BLIP_SELECT, TEXT_BTN_BLIP_SELECT_DESCRIPTION, param.generateBlipSelect() )
-
-      BTN(TEXT_BTN_MUTATE, TEXT_BTN_MUTATE_DESCRIPTION, param.mutate() ) ImGui::SameLine();
-      BTN(TEXT_BTN_RANDOMIZE, TEXT_BTN_RANDOMIZE_DESCRIPTION, param.randomize() )
+      BTN(TEXT_BTN_PICKUP_COIN, TEXT_BTN_PICKUP_COIN_DESCRIPTION, NextSound(Generator::PickupCoin) ) ImGui::SameLine();
+      BTN(TEXT_BTN_LASER_SHOOT, TEXT_BTN_LASER_SHOOT_DESCRIPTION, NextSound(Generator::LaserShoot) ) ImGui::SameLine();
+      BTN(TEXT_BTN_EXPLOSION, TEXT_BTN_EXPLOSION_DESCRIPTION, NextSound(Generator::Explosion) ) ImGui::SameLine();
+      BTN(TEXT_BTN_POWERUP, TEXT_BTN_POWERUP_DESCRIPTION, NextSound(Generator::Powerup) ) ImGui::SameLine();
+      BTN(TEXT_BTN_HIT_HURT, TEXT_BTN_HIT_HURT_DESCRIPTION, NextSound(Generator::HitHurt) ) ImGui::SameLine();
+      BTN(TEXT_BTN_JUMP, TEXT_BTN_JUMP_DESCRIPTION, NextSound(Generator::Jump) ) ImGui::SameLine();
+      BTN(TEXT_BTN_BLIP_SELECT, TEXT_BTN_BLIP_SELECT_DESCRIPTION, NextSound(Generator::BlipSelect) )
+
+      BTN(TEXT_BTN_MUTATE, TEXT_BTN_MUTATE_DESCRIPTION, NextSound(Generator::Mutate) ) ImGui::SameLine();
+      BTN(TEXT_BTN_RANDOMIZE, TEXT_BTN_RANDOMIZE_DESCRIPTION, NextSound(Generator::Randomize) )
 #undef BTN
 
-      if(ImGui::Button("Synth sound")) { SynthSound(); } ImGui::SameLine();
-      if(ImGui::Button("Play sound")) { SynthSound(); PlaySound(samples.size()); }
+      if(ImGui::Button("Synth sound")) { SynthSound(false); } ImGui::SameLine();
+      if(ImGui::Button("Play sound")) { PlayCurrentSound(); }
 
-      ImGui::Checkbox("Play on change", &play_on_change);
+      ImGui::Checkbox("Play on change", &play_on_change); ImGui::SameLine();
+      ImGui::Checkbox("Stream playback", &stream_playback);
+      if(synthesizer.Busy())
+      {
+        ImGui::SameLine();
+        ImGui::TextDisabled("Rendering...");
+      }
 
-      if(!samples.empty())
+      if(samples && peaks.Size() > 0)
       {
-        ImGui::PlotLines("Sample", &double_to_float, &samples, samples.size(), 0, nullptr, -1.0f, 1.0f, ImVec2{0, 120});
+        DrawWaveform();
       }
-      if(!samples.empty() && ImGui::Button("Save wav"))
+      if((samples || streaming) && ImGui::Button("Save wav"))
       {
         nfdchar_t* target = NULL;
         const auto r = NFD_SaveDialog("*.wav", nullptr, &target);
         if(r == NFD_OKAY)
         {
+          // a sound still being rendered is finished here instead
+          if(!samples || synthesizer.Busy())
+          {
+            SynthSoundNow();
+          }
           std::string file = target;
           free(target);
           if(!hasEnding(file, ".wav"))
           {
             file += ".wav";
           }
-          bfxr::SaveWav(file.c_str(), samples);
+          bfxr::SaveWav(file.c_str(), *samples, sample_frequency);
         }
       }
       ImGui::Separator();
@@ -479,34 +1197,359 @@ class App : public AppBase
         }while(false)
       ALLVALUES
 #undef ONVAR
+
+      if(ImGui::CollapsingHeader("Audio device"))
+      {
+        DrawAudioDevice();
+      }
       if (sound_changed && play_on_change)
       {
-        SynthSound();
-        PlaySound(samples.size());
+        PlayCurrentSound();
       }
     }
     ImGui::End();
+
+    // the locks change what mutate does without changing the sound
+    speculator.SetBase(param);
   }
 
-  void SynthSound() { samples.resize(0); bfxr::GenerateSound(param, &samples); }
+  // Device and buffer size pickers and how well the callback keeps up with
+  // them, to find the smallest buffer that doesn't glitch
+  void DrawAudioDevice()
+  {
+    const char* current = audio_device_name.empty() ? "Default" : audio_device_name.c_str();
+    if(ImGui::BeginCombo("Device", current))
+    {
+      if(ImGui::Selectable("Default", audio_device_name.empty()))
+      {
+        ReopenAudio("", audio_buffer_size);
+      }
+      const int count = SDL_GetNumAudioDevices(0);
+      for(int i = 0; i < count; i += 1)
+      {
+        const char* name = SDL_GetAudioDeviceName(i, 0);
+        if(name != nullptr && ImGui::Selectable(name, audio_device_name == name))
+        {
+          ReopenAudio(name, audio_buffer_size);
+        }
+      }
+      ImGui::EndCombo();
+    }
 
-  bool play_on_change = true;
-  bfxr::BfxrParams param;
-  std::vector<double> samples;
+    const std::string size = std::to_string(audio_buffer_size);
+    if(ImGui::BeginCombo("Buffer size", size.c_str()))
+    {
+      for(const int samples : audio_buffer_sizes)
+      {
+        const std::string label = std::to_string(samples);
+        if(ImGui::Selectable(label.c_str(), samples == audio_buffer_size))
+        {
+          ReopenAudio(audio_device_name, samples);
+        }
+      }
+      ImGui::EndCombo();
+    }
 
-  float
-  SynthSample(int time) override
+    if(audio_device == 0)
+    {
+      ImGui::TextDisabled("No audio device");
+      return;
+    }
+
+    ImGui::Text("Device buffer: %d samples, %.1f ms at %d Hz",
+        audio_spec.samples, BufferMs(audio_spec.samples), audio_spec.freq);
+    ImGui::Text("Output latency: %.1f ms", output_latency.load(std::memory_order_relaxed));
+    ImGui::Text("Callback: %.2f ms, max %.2f ms",
+        audio_callback_time.load(std::memory_order_relaxed),
+        max_callback_time.load(std::memory_order_relaxed));
+    ImGui::Text("Callback jitter: %.2f ms, max %.2f ms",
+        callback_jitter.load(std::memory_order_relaxed),
+        max_callback_jitter.load(std::memory_order_relaxed));
+    ImGui::Text("Underruns: %d late, %d slow callbacks",
+        late_callbacks.load(std::memory_order_relaxed),
+        slow_callbacks.load(std::memory_order_relaxed));
+    ImGui::Text("Samples played: %llu",
+        static_cast<unsigned long long>(samples_consumed.load(std::memory_order_relaxed)));
+    if(ImGui::Button("Reset"))
+    {
+      reset_audio_stats.store(true, std::memory_order_relaxed);
+    }
+  }
+
+  // The part of the sound in view, one min/max line per pixel from the peak
+  // pyramid. The wheel zooms around the mouse, dragging with the right button
+  // pans, double clicking it shows everything again and a click plays from
+  // where it is
+  void DrawWaveform()
+  {
+    const ImVec2 size{ImGui::CalcItemWidth(), 120};
+    const ImVec2 origin = ImGui::GetCursorScreenPos();
+    ImGui::InvisibleButton("Sample", size);
+
+    const double length = static_cast<double>(peaks.Size());
+    const double shortest = std::min(length, std::max(2.0, size.x / 8.0));
+    const auto clamp_view = [&]()
+    {
+      view_samples = std::max(shortest, std::min(view_samples, length));
+      view_begin   = std::max(0.0, std::min(view_begin, length - view_samples));
+    };
+    if(view_samples <= 0)
+    {
+      view_samples = length;
+    }
+    clamp_view();
+
+    const ImGuiIO& io = ImGui::GetIO();
+    const double mouse = (io.MousePos.x - origin.x) / size.x;
+    if(ImGui::IsItemHovered())
+    {
+      if(io.MouseWheel != 0)
+      {
+        const double anchor = view_begin + mouse * view_samples;
+        view_samples *= std::pow(0.8, io.MouseWheel);
+        view_begin = anchor - mouse * view_samples;
+        clamp_view();
+      }
+      if(ImGui::IsMouseDragging(1))
+      {
+        view_begin -= ImGui::GetMouseDragDelta(1).x * view_samples / size.x;
+        ImGui::ResetMouseDragDelta(1);
+        clamp_view();
+      }
+      if(ImGui::IsMouseDoubleClicked(1))
+      {
+        view_begin   = 0;
+        view_samples = length;
+      }
+    }
+    if(ImGui::IsItemClicked() && mouse >= 0 && mouse < 1)
+    {
+      PlaySoundFrom(static_cast<std::size_t>(view_begin + mouse * view_samples));
+    }
+
+    // showing everything keeps showing everything when the length changes
+    const double visible = view_samples;
+    if(visible >= length)
+    {
+      view_samples = 0;
+    }
+
+    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+    const ImVec2 end{origin.x + size.x, origin.y + size.y};
+    draw_list->AddRectFilled(origin, end, ImGui::GetColorU32(ImGuiCol_FrameBg));
+    draw_list->PushClipRect(origin, end, true);
+
+    const ImU32 color = ImGui::GetColorU32(ImGuiCol_PlotLines);
+    const float middle = origin.y + size.y * 0.5f;
+    const float scale = size.y * 0.5f;
+    const auto y = [&](float value)
+    {
+      return middle - std::max(-1.0f, std::min(value, 1.0f)) * scale;
+    };
+
+    const double per_pixel = visible / size.x;
+    if(per_pixel >= 1)
+    {
+      // each column includes the first sample of the next one so they join up
+      const int columns = static_cast<int>(size.x);
+      for(int x = 0; x < columns; x += 1)
+      {
+        const auto begin = static_cast<std::size_t>(view_begin + x * per_pixel);
+        const auto next  = static_cast<std::size_t>(view_begin + (x + 1) * per_pixel);
+        float min = 0, max = 0;
+        peaks.Range(begin, next + 1, &min, &max);
+        const float column = origin.x + x + 0.5f;
+        draw_list->AddLine(ImVec2{column, y(max)}, ImVec2{column, y(min) + 1}, color);
+      }
+    }
+    else
+    {
+      // zoomed in past one sample per pixel, lines between the samples
+      const auto first = static_cast<std::size_t>(view_begin);
+      const auto last  = std::min(
+          peaks.Size() - 1, static_cast<std::size_t>(std::ceil(view_begin + visible)));
+      for(std::size_t i = first; i < last; i += 1)
+      {
+        const float x0 = origin.x + static_cast<float>((i - view_begin) / per_pixel);
+        const float x1 = origin.x + static_cast<float>((i + 1 - view_begin) / per_pixel);
+        draw_list->AddLine(ImVec2{x0, y(peaks.Sample(i))}, ImVec2{x1, y(peaks.Sample(i + 1))}, color);
+      }
+    }
+
+    draw_list->PopClipRect();
+  }
+
+  // Uses the result the speculator rolled when it has one
+  void NextSound(Generator generator)
+  {
+    if(!speculator.Take(generator, &param))
+    {
+      Generate(generator, &param, bfxr::DefaultRandom());
+    }
+  }
+
+  bfxr::RenderSettings Settings() const
+  {
+    bfxr::RenderSettings settings;
+    settings.sampleRate = sample_frequency;
+    return settings;
+  }
+
+  // Shows the sound and plays it if asked to, right away when it is in the
+  // cache and once the synthesizer has rendered it otherwise
+  void SynthSound(bool play)
+  {
+    const auto settings = Settings();
+    if(const auto cached = cache.find(param, settings))
+    {
+      UseCachedSound(cached, play);
+    }
+    else
+    {
+      synthesizer.Request(param, settings, play);
+    }
+  }
+
+  // Renders the sound on this thread, for when it is needed right away
+  void SynthSoundNow()
   {
-    if(samples.empty()) { return 0.0f; }
-    else return samples[time];
+    synthesizer.Cancel();
+    const auto settings = Settings();
+    if(const auto cached = cache.find(param, settings))
+    {
+      UseCachedSound(cached, false);
+      return;
+    }
+
+    bfxr::SynthCheckpoints sound_checkpoints;
+    std::vector<double> rendered;
+    bfxr::BfxrSynth synth{param, settings};
+    synth.GenerateSound(&rendered, &sound_checkpoints);
+    auto sound = cache.insert(param, settings, std::move(rendered));
+    UseSound(param, std::move(sound), std::move(sound_checkpoints), false);
   }
+
+  // The cache only keeps the samples, the sound is used right away and the
+  // synthesizer renders it again for the checkpoints seeking needs. It hands
+  // back the same samples from the cache along with them. Replaying the sound
+  // that is shown keeps its checkpoints, they are only rendered again when
+  // they were cancelled before they were done
+  void UseCachedSound(std::shared_ptr<const std::vector<double>> sound, bool play)
+  {
+    const bool shown = sound == samples && param.serialize() == sound_param.serialize();
+    if(!shown)
+    {
+      UseSound(param, std::move(sound), bfxr::SynthCheckpoints(), play);
+      synthesizer.Request(param, Settings(), false);
+      return;
+    }
+
+    streaming = false;
+    if(play)
+    {
+      PlaySound(samples);
+    }
+    if(checkpoints.size() == 0 && !synthesizer.Busy())
+    {
+      synthesizer.Request(param, Settings(), false);
+    }
+  }
+
+  void PollSynthesizer()
+  {
+    Synthesizer::Sound sound;
+    if(synthesizer.Poll(&sound))
+    {
+      UseSound(sound.params, std::move(sound.samples), std::move(sound.checkpoints), sound.play);
+    }
+  }
+
+  void UseSound(const bfxr::BfxrParams& params, std::shared_ptr<const std::vector<double>> sound, bfxr::SynthCheckpoints sound_checkpoints, bool play)
+  {
+    sound_param = params;
+    checkpoints = std::move(sound_checkpoints);
+    if(sound != samples)
+    {
+      peaks.Build(*sound);
+    }
+    samples = std::move(sound);
+    streaming = false;
+    if(play)
+    {
+      PlaySound(samples);
+    }
+  }
+
+  // Streams the rendered sound from the given sample, the synth is restored
+  // from the closest checkpoint instead of rendering everything before it
+  void PlaySoundFrom(std::size_t sample)
+  {
+    std::unique_ptr<bfxr::BfxrSynth> synth(new bfxr::BfxrSynth(sound_param, Settings()));
+    checkpoints.seek(synth.get(), sample);
+    PlaySynth(std::move(synth));
+  }
+
+  // Gives the audio callback a new synth to pull from, playback starts with
+  // the next audio buffer instead of after the whole sound is rendered. The
+  // synthesizer still renders it for the waveform and seeking, until then
+  // they show the previous sound
+  void StreamSound()
+  {
+    const auto settings = Settings();
+    PlaySynth(std::unique_ptr<bfxr::BfxrSynth>(new bfxr::BfxrSynth(param, settings)));
+    synthesizer.Request(param, settings, false);
+    streaming = true;
+  }
+
+  void PlayCurrentSound()
+  {
+    // sounds already in the cache, like the ones the speculator rendered,
+    // play from there even when streaming
+    if(stream_playback && !cache.find(param, Settings()))
+    {
+      StreamSound();
+    }
+    else
+    {
+      SynthSound(true);
+    }
+  }
+
+  bool play_on_change = true;
+  bool stream_playback = true;
+  bfxr::BfxrParams param;
+  std::shared_ptr<const std::vector<double>> samples;
+  bool streaming = false;		// the current params are streamed while they are rendered
+  PeakPyramid peaks;	// of samples
+  double view_begin = 0;	// the samples the waveform shows, kept across sounds
+  double view_samples = 0;	// 0 shows the whole sound
+
+  // the params samples was rendered with and the synth states along the way
+  bfxr::BfxrParams sound_param;
+  bfxr::SynthCheckpoints checkpoints;
+
+  // replaying a sound or going back to one that was played before doesn't
+  // render it again
+  bfxr::RenderCache cache;
+  Speculator speculator{&cache, Settings()};
+  Synthesizer synthesizer{&cache};
 };
 
 int
-main(int, char**)
+main(int argc, char** argv)
 {
+  // --s16 opens the device with 16 bit samples, for drivers sdl would have
+  // to convert the floats for anyway
+  bool float_output = true;
+  int buffer_samples = 1024;
+  for(int i = 1; i < argc; i += 1)
+  {
+    const std::string arg = argv[i];
+    if(arg == "--s16") { float_output = false; }
+    else if(arg == "--buffer" && i + 1 < argc) { buffer_samples = std::atoi(argv[++i]); }
+  }
 
-  App app;
+  App app(float_output, buffer_samples);
   if(!app.ok)
   {
     return -1;
@@ -0,0 +1,122 @@
+// Renders a batch of random sounds in both double and single precision and
+// reports how far the single precision output is from the double reference,
+// per wave type, over the full length of each sound.
+// Usage: bfxr_compare_precision [sounds per wave] [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "bfxr.h"
+
+namespace
+{
+  const char* const wave_names[] =
+  {
+    "Square", "Saw", "Sin", "Noise", "Triangle", "Pink",
+    "Tan", "Whistle", "Breaker", "OneBitNoise", "Buzz"
+  };
+
+  struct Deviation
+  {
+    double max_error = 0.0;
+    double squared_error = 0.0;
+    std::size_t samples = 0;
+    std::size_t length_mismatches = 0;
+  };
+
+  void Generate(bfxr::BfxrParams* params, bfxr::Random& random, int index)
+  {
+    switch(index % 8)
+    {
+      case 0: params->generatePickupCoin(random); break;
+      case 1: params->generateLaserShoot(random); break;
+      case 2: params->generateExplosion(random); break;
+      case 3: params->generatePowerup(random); break;
+      case 4: params->generateHitHurt(random); break;
+      case 5: params->generateJump(random); break;
+      case 6: params->generateBlipSelect(random); break;
+      default: params->randomize(random); break;
+    }
+  }
+
+  // Renders the full length of the sound. GenerateSound trims the zeros at the
+  // end, and where the fade out rounds to zero differs between the precisions
+  template<typename T>
+  std::vector<T> Render(const bfxr::BfxrParams& params, const bfxr::RenderSettings& settings)
+  {
+    bfxr::BfxrSynth synth(params, settings);
+    std::vector<T> data(synth.GetNumberOfSamples());
+    data.resize(synth.renderBlock(data.data(), data.size()));
+    return data;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const int sounds = argc > 1 ? std::atoi(argv[1]) : 50;
+  const int seed = argc > 2 ? std::atoi(argv[2]) : 1;
+
+  bfxr::RenderSettings double_settings;
+  double_settings.precision = bfxr::Precision::Double;
+  bfxr::RenderSettings float_settings;
+  float_settings.precision = bfxr::Precision::Float;
+
+  std::printf("%-12s %14s %14s %10s\n", "wave", "max abs error", "rms error", "samples");
+
+  Deviation total;
+  for(int wave = 0; wave < static_cast<int>(bfxr::WaveType::COUNT); wave += 1)
+  {
+    Deviation deviation;
+    for(int i = 0; i < sounds; i += 1)
+    {
+      const int sound_seed = seed + wave * sounds + i;
+      bfxr::Random random(sound_seed);
+      bfxr::BfxrParams params;
+      Generate(&params, random, i);
+      params.waveType = static_cast<bfxr::WaveType>(wave);
+
+      // both renders needs the same noise
+      double_settings.seed = sound_seed;
+      float_settings.seed = sound_seed;
+
+      const auto reference = Render<double>(params, double_settings);
+      const auto single = Render<float>(params, float_settings);
+
+      if(reference.size() != single.size())
+      {
+        deviation.length_mismatches += 1;
+      }
+
+      const auto count = std::min(reference.size(), single.size());
+      for(std::size_t s = 0; s < count; s += 1)
+      {
+        const double error = std::abs(reference[s] - static_cast<double>(single[s]));
+        deviation.max_error = std::max(deviation.max_error, error);
+        deviation.squared_error += error * error;
+      }
+      deviation.samples += count;
+    }
+
+    std::printf("%-12s %14.3e %14.3e %10zu\n", wave_names[wave], deviation.max_error,
+        deviation.samples > 0 ? std::sqrt(deviation.squared_error / deviation.samples) : 0.0,
+        deviation.samples);
+    if(deviation.length_mismatches > 0)
+    {
+      std::printf("  %zu sounds had a different length\n", deviation.length_mismatches);
+    }
+
+    total.max_error = std::max(total.max_error, deviation.max_error);
+    total.squared_error += deviation.squared_error;
+    total.samples += deviation.samples;
+    total.length_mismatches += deviation.length_mismatches;
+  }
+
+  std::printf("%-12s %14.3e %14.3e %10zu\n", "all", total.max_error,
+      total.samples > 0 ? std::sqrt(total.squared_error / total.samples) : 0.0,
+      total.samples);
+
+  return total.length_mismatches > 0 ? 1 : 0;
+}
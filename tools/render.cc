@@ -0,0 +1,427 @@
+// Renders parameter files to wav without the gui, on all the cores of the
+// machine. Each input is a .bfxrsound file, a directory whose .bfxrsound files
+// are all rendered, or a manifest listing one parameter file per line.
+// Sounds with the same params are only rendered once while they fit in the
+// cache. Inputs whose names would give the same wav are refused before
+// anything is rendered.
+// Usage: bfxr_render [-o output dir] [-j threads] [-r sample rate] [-c cache MB] [-q] inputs...
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <map>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "bfxr.h"
+
+namespace
+{
+  using Clock = std::chrono::steady_clock;
+
+  const char* const extension = ".bfxrsound";
+
+  struct Job
+  {
+    std::string input;
+    std::string output;
+  };
+
+  struct Result
+  {
+    bool ok = false;
+    std::size_t samples = 0;
+    double render_seconds = 0.0;
+    double total_seconds = 0.0;	// render, read and write
+  };
+
+  bool EndsWith(const std::string& str, const std::string& end)
+  {
+    return str.size() >= end.size() && str.compare(str.size() - end.size(), end.size(), end) == 0;
+  }
+
+  bool IsDirectory(const std::string& path)
+  {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFDIR) != 0;
+  }
+
+  std::string Join(const std::string& directory, const std::string& name)
+  {
+    if(directory.empty()) return name;
+    const char last = directory.back();
+    if(last == '/' || last == '\\') return directory + name;
+    return directory + "/" + name;
+  }
+
+  std::string Directory(const std::string& path)
+  {
+    const auto slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string() : path.substr(0, slash);
+  }
+
+  std::string Stem(const std::string& path)
+  {
+    const auto slash = path.find_last_of("/\\");
+    auto name = slash == std::string::npos ? path : path.substr(slash + 1);
+    const auto dot = name.find_last_of('.');
+    if(dot != std::string::npos && dot > 0) name.resize(dot);
+    return name;
+  }
+
+  // Case folded where the file system ignores case, for finding jobs that
+  // would write the same file
+  std::string OutputKey(const std::string& path)
+  {
+    std::string key = path;
+#if defined(_WIN32) || defined(__APPLE__)
+    for(auto& c : key) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+#endif
+    return key;
+  }
+
+  // Sorted so the jobs and the report are in the same order on every run
+  std::vector<std::string> ListSounds(const std::string& directory)
+  {
+    std::vector<std::string> files;
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    const HANDLE find = FindFirstFileA(Join(directory, "*").c_str(), &data);
+    if(find != INVALID_HANDLE_VALUE)
+    {
+      do
+      {
+        const std::string name = data.cFileName;
+        if((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 && EndsWith(name, extension))
+        {
+          files.push_back(Join(directory, name));
+        }
+      } while(FindNextFileA(find, &data));
+      FindClose(find);
+    }
+#else
+    if(DIR* dir = opendir(directory.c_str()))
+    {
+      while(const dirent* entry = readdir(dir))
+      {
+        const std::string name = entry->d_name;
+        const auto path = Join(directory, name);
+        if(EndsWith(name, extension) && !IsDirectory(path))
+        {
+          files.push_back(path);
+        }
+      }
+      closedir(dir);
+    }
+#endif
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  // Paths in a manifest are relative to the manifest, empty lines and lines
+  // starting with # are skipped
+  bool ReadManifest(const std::string& manifest, std::vector<std::string>* files)
+  {
+    std::ifstream file(manifest);
+    if(!file) return false;
+
+    const auto base = Directory(manifest);
+    std::string line;
+    while(std::getline(file, line))
+    {
+      while(!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) line.pop_back();
+      if(line.empty() || line[0] == '#') continue;
+
+      const bool absolute = line[0] == '/' || line[0] == '\\' || (line.size() > 1 && line[1] == ':');
+      files->push_back(absolute ? line : Join(base, line));
+    }
+    return true;
+  }
+
+  bool ReadParams(const std::string& path, bfxr::BfxrParams* params)
+  {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+    std::stringstream contents;
+    contents << file.rdbuf();
+    return params->deserialize(contents.str());
+  }
+
+  double Seconds(Clock::duration duration)
+  {
+    return std::chrono::duration<double>(duration).count();
+  }
+
+  // Every worker takes jobs from the back of its own queue and steals from the
+  // front of the others once it runs dry, so a few long sounds at the end of
+  // one queue don't leave the other threads idle. All jobs are queued before
+  // the workers start, a worker is done when every queue is empty
+  class WorkQueues
+  {
+    public:
+      explicit WorkQueues(std::size_t workers)
+      {
+        for(std::size_t i = 0; i < workers; i += 1)
+        {
+          _queues.emplace_back(new Queue());
+        }
+      }
+
+      void push(std::size_t worker, std::size_t job)
+      {
+        _queues[worker]->jobs.push_back(job);
+      }
+
+      bool pop(std::size_t worker, std::size_t* job)
+      {
+        {
+          Queue& own = *_queues[worker];
+          std::lock_guard<std::mutex> lock(own.mutex);
+          if(!own.jobs.empty())
+          {
+            *job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+          }
+        }
+
+        for(std::size_t i = 1; i < _queues.size(); i += 1)
+        {
+          Queue& victim = *_queues[(worker + i) % _queues.size()];
+          std::lock_guard<std::mutex> lock(victim.mutex);
+          if(!victim.jobs.empty())
+          {
+            *job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+          }
+        }
+
+        return false;
+      }
+
+    private:
+      struct Queue
+      {
+        std::mutex mutex;
+        std::deque<std::size_t> jobs;
+      };
+
+      std::vector<std::unique_ptr<Queue>> _queues;
+  };
+
+  Result Render(const Job& job, const bfxr::RenderSettings& settings, bfxr::RenderCache* cache)
+  {
+    Result result;
+    const auto start = Clock::now();
+
+    bfxr::BfxrParams params;
+    if(!ReadParams(job.input, &params))
+    {
+      std::fprintf(stderr, "%s: not a bfxr sound, or a value is out of range\n", job.input.c_str());
+      return result;
+    }
+
+    const auto render_start = Clock::now();
+    const auto data = cache->get(params, settings);
+    result.render_seconds = Seconds(Clock::now() - render_start);
+    result.samples = data->size();
+    if(data->empty())
+    {
+      std::fprintf(stderr, "%s: the sound has no samples\n", job.input.c_str());
+      return result;
+    }
+
+    if(!bfxr::SaveWav(job.output.c_str(), *data, settings.sampleRate))
+    {
+      std::fprintf(stderr, "%s: failed to write %s\n", job.input.c_str(), job.output.c_str());
+      return result;
+    }
+
+    result.total_seconds = Seconds(Clock::now() - start);
+    result.ok = true;
+    return result;
+  }
+
+  void PrintUsage()
+  {
+    std::fprintf(stderr,
+        "usage: bfxr_render [-o output dir] [-j threads] [-r sample rate] [-c cache MB] [-q] inputs...\n"
+        "  inputs are %s files, directories of them or manifests listing one per line\n",
+        extension);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  std::string output_directory = ".";
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  bool quiet = false;
+  std::size_t cache_megabytes = 256;
+  bfxr::RenderSettings settings;
+
+  std::vector<std::string> inputs;
+  for(int i = 1; i < argc; i += 1)
+  {
+    const std::string arg = argv[i];
+    const bool has_value = i + 1 < argc;
+    if(arg == "-o" && has_value) output_directory = argv[++i];
+    else if(arg == "-j" && has_value) threads = std::max(1, std::atoi(argv[++i]));
+    else if(arg == "-r" && has_value) settings.sampleRate = std::atoi(argv[++i]);
+    else if(arg == "-c" && has_value) cache_megabytes = std::max(0, std::atoi(argv[++i]));
+    else if(arg == "-q") quiet = true;
+    else if(arg == "-h" || arg == "--help")
+    {
+      PrintUsage();
+      return 0;
+    }
+    else if(arg[0] == '-' && arg.size() > 1)
+    {
+      PrintUsage();
+      return 2;
+    }
+    else inputs.push_back(arg);
+  }
+
+  if(inputs.empty() || settings.sampleRate <= 0)
+  {
+    PrintUsage();
+    return 2;
+  }
+
+  std::vector<std::string> files;
+  for(const auto& input : inputs)
+  {
+    if(IsDirectory(input))
+    {
+      const auto sounds = ListSounds(input);
+      files.insert(files.end(), sounds.begin(), sounds.end());
+    }
+    else if(EndsWith(input, extension))
+    {
+      files.push_back(input);
+    }
+    else if(!ReadManifest(input, &files))
+    {
+      std::fprintf(stderr, "%s: can't read manifest\n", input.c_str());
+      return 1;
+    }
+  }
+
+  std::vector<Job> jobs(files.size());
+  for(std::size_t i = 0; i < files.size(); i += 1)
+  {
+    jobs[i].input = files[i];
+    jobs[i].output = Join(output_directory, Stem(files[i]) + ".wav");
+  }
+
+  // outputs are named after the input without its directory, two inputs with
+  // the same name would overwrite each other, and race with several threads
+  std::map<std::string, std::size_t> outputs;
+  bool duplicates = false;
+  for(std::size_t i = 0; i < jobs.size(); i += 1)
+  {
+    const auto inserted = outputs.emplace(OutputKey(jobs[i].output), i);
+    if(!inserted.second)
+    {
+      std::fprintf(stderr, "%s and %s both render to %s\n", jobs[inserted.first->second].input.c_str(),
+          jobs[i].input.c_str(), jobs[i].output.c_str());
+      duplicates = true;
+    }
+  }
+  if(duplicates)
+  {
+    return 1;
+  }
+
+  threads = std::max<std::size_t>(1, std::min(threads, jobs.size()));
+
+  // neighbouring jobs go to the same worker, they often come from the same
+  // directory
+  WorkQueues queues(threads);
+  for(std::size_t i = 0; i < jobs.size(); i += 1)
+  {
+    queues.push(i * threads / jobs.size(), i);
+  }
+
+  bfxr::RenderCache cache(cache_megabytes * 1024 * 1024);
+  std::vector<Result> results(jobs.size());
+  const auto start = Clock::now();
+  {
+    std::vector<std::thread> workers;
+    for(std::size_t worker = 0; worker < threads; worker += 1)
+    {
+      workers.emplace_back([&, worker]()
+      {
+        std::size_t job = 0;
+        while(queues.pop(worker, &job))
+        {
+          results[job] = Render(jobs[job], settings, &cache);
+        }
+      });
+    }
+    for(auto& thread : workers)
+    {
+      thread.join();
+    }
+  }
+  const double wall_seconds = Seconds(Clock::now() - start);
+
+  std::size_t rendered = 0;
+  std::size_t samples = 0;
+  double render_seconds = 0.0;
+  if(!quiet)
+  {
+    std::printf("%-40s %10s %10s %14s\n", "sound", "samples", "ms", "samples/s");
+  }
+  for(std::size_t i = 0; i < jobs.size(); i += 1)
+  {
+    const auto& result = results[i];
+    if(!result.ok) continue;
+    rendered += 1;
+    samples += result.samples;
+    render_seconds += result.render_seconds;
+    if(!quiet)
+    {
+      std::printf("%-40s %10zu %10.2f %14.0f\n", Stem(jobs[i].input).c_str(), result.samples,
+          result.total_seconds * 1000.0,
+          result.render_seconds > 0.0 ? result.samples / result.render_seconds : 0.0);
+    }
+  }
+
+  // the synth time is summed over the threads, the wall time includes reading
+  // and writing the files
+  std::printf("%zu of %zu sounds, %zu samples in %.3f s on %zu threads\n",
+      rendered, jobs.size(), samples, wall_seconds, threads);
+  if(wall_seconds > 0.0)
+  {
+    std::printf("%.1f sounds/s, %.0f samples/s\n", rendered / wall_seconds, samples / wall_seconds);
+  }
+  if(render_seconds > 0.0)
+  {
+    std::printf("synth alone: %.0f samples/s per thread\n", samples / render_seconds);
+  }
+  std::printf("cache: %llu hits, %llu misses\n",
+      static_cast<unsigned long long>(cache.hits()), static_cast<unsigned long long>(cache.misses()));
+
+  return rendered == jobs.size() ? 0 : 1;
+}